@@ -0,0 +1,64 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-11-27 14:20:05
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-11-27 14:20:05
+ * @Description  : batch runner for many independent virtual machines
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace virtual_machine_nsp {
+
+// One line of the manifest: program [register file [input file]]
+struct batch_job_tp {
+    std::string program;
+    std::string register_file;
+    std::string input_file;
+};
+
+struct batch_result_tp {
+    register_tp reg;
+    uint64_t cycles = 0;
+    bool halted = false;
+    std::string error;
+};
+
+// Fixed set of workers, each with its own deque of task indices. A worker
+// pops from the back of its own deque and, once that is empty, steals from
+// the front of the others, so long jobs do not leave the other cores idle.
+class work_stealing_pool_tp {
+    private:
+    struct worker_queue_tp {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+    std::vector<std::unique_ptr<worker_queue_tp>> queues;
+
+    bool PopLocal(size_t worker, size_t &task);
+    bool Steal(size_t thief, size_t &task);
+
+    public:
+    explicit work_stealing_pool_tp(size_t thread_count);
+    size_t Size() const { return queues.size(); }
+    // Run task(0) ... task(count - 1) and wait for all of them
+    void Run(size_t count, const std::function<void(size_t)> &task);
+};
+
+std::vector<batch_job_tp> ReadBatchManifest(const std::string &filename);
+batch_result_tp RunBatchJob(const batch_job_tp &job, const std::shared_ptr<const memory_image_tp> &image,
+                            int16_t address, uint64_t max_steps);
+// One "index name state cycle=... R0=... PC=... COND=..." line
+void WriteBatchResult(std::ostream &out, size_t index, const std::string &name, const batch_result_tp &result);
+// Run every job of the manifest and write all results to one file, returns the failed job count
+int RunBatch(const std::string &manifest, const std::string &results, size_t thread_count,
+             int16_t address, uint64_t max_steps);
+
+}; // virtual machine namespace
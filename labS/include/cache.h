@@ -0,0 +1,101 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-10 16:47:35
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-10 16:47:35
+ * @Description  : guest memory cache model
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+#include "observer.h"
+
+namespace virtual_machine_nsp {
+
+// Sizes are in LC-3 words. Written as "size:ways:line[:lru|fifo][:wb|wt]"
+// on the command line, e.g. "1024:4:8:lru:wb".
+struct cache_config_tp {
+    int size = 1024;
+    int ways = 4;
+    int line = 8;
+    bool lru = true;
+    bool write_back = true;
+    uint64_t latency = 1;
+};
+
+bool ParseCacheConfig(const std::string &text, cache_config_tp &config, std::string &error);
+// "l1:l2:memory" latencies in cycles
+bool ParseCacheLatency(const std::string &text, cache_config_tp &l1, cache_config_tp &l2, uint64_t &memory,
+                       std::string &error);
+
+struct cache_stats_tp {
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t read_misses = 0;
+    uint64_t write_misses = 0;
+    uint64_t writebacks = 0;
+};
+
+// One set associative level. Misses and write backs go to next, or to
+// memory when there is no next level. Write back caches allocate on a write
+// miss, write through caches do not.
+class cache_tp {
+    private:
+    struct line_tp {
+        uint16_t tag;
+        bool valid;
+        bool dirty;
+        uint64_t stamp;   // last use for LRU, fill time for FIFO
+    };
+    cache_config_tp config;
+    cache_tp *next;
+    uint64_t memory_latency;
+    int set_count;
+    int line_shift;
+    std::vector<line_tp> lines;
+    uint64_t clock = 0;
+
+    uint64_t Below(uint16_t address, bool write);
+
+    public:
+    cache_stats_tp stats;
+    bool last_missed = false;
+
+    cache_tp(const cache_config_tp &config, cache_tp *next, uint64_t memory_latency);
+    // Returns the latency of the access
+    uint64_t Access(uint16_t address, bool write);
+    const cache_config_tp &Config() const { return config; }
+};
+
+// --cache: every fetch and data access goes through the modelled hierarchy.
+// Each access costs the latency of the level that served it, and the
+// modelled cycle count is the sum over the run.
+struct cache_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    std::unique_ptr<cache_tp> l2;
+    std::unique_ptr<cache_tp> l1;
+    uint64_t modelled_cycles = 0;
+    uint16_t current_pc = 0;
+    uint64_t pc_accesses[kVirtualMachineMemorySize] = {};
+    uint64_t pc_misses[kVirtualMachineMemorySize] = {};
+
+    // About 1MB, allocate it on the heap
+    cache_observer_tp(const cache_config_tp &l1_config, const cache_config_tp *l2_config, uint64_t memory_latency);
+    void Account(uint64_t latency) {
+        modelled_cycles += latency;
+        ++pc_accesses[current_pc];
+        pc_misses[current_pc] += l1->last_missed;
+    }
+    void Fetch(uint16_t address) { Account(l1->Access(address, false)); }
+    void Read(uint16_t address) { Account(l1->Access(address, false)); }
+    void Write(uint16_t address) { Account(l1->Access(address, true)); }
+    template <typename Machine> void BeforeExecute(Machine &vm, uint16_t pc, const instruction_tp &inst) {
+        current_pc = pc;
+        VisitAccesses(vm, pc, inst, *this);
+    }
+    template <typename Machine> void AfterExecute(Machine &, uint16_t, const instruction_tp &) {}
+    void PrintReport(std::ostream &os, size_t top = 16) const;
+};
+
+}; // virtual machine namespace
@@ -9,13 +9,16 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstdio>
 
 #include <array>
+#include <memory>
 #include <vector>
 #include <cmath>
 #include <climits>
 #include <cstdlib>
+#include <cstdint>
 #include <string>
 #include <cstring>
 #include <algorithm>
@@ -29,4 +32,14 @@ extern bool gIsDetailedMode;
 extern std::string gInputFileName;
 extern std::string gRegisterStatusFileName;
 extern std::string gOutputFileName;
-extern int gBeginningAddress;
\ No newline at end of file
+extern int gBeginningAddress;
+extern int gEngine;
+extern bool gIsFusionReportMode;
+extern std::string gBatchManifestFileName;
+extern std::string gBatchResultFileName;
+extern std::string gLockstepManifestFileName;
+extern int gThreadCount;
+extern uint64_t gMaxSteps;
+extern uint64_t gSnapshotCycle;
+extern std::string gSnapshotFileName;
+extern std::string gRestoreFileName;
\ No newline at end of file
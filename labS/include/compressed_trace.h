@@ -0,0 +1,113 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-05 15:20:44
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-05 15:20:44
+ * @Description  : chunked, delta encoded trace container with a seek index
+ */
+#pragma once
+
+#include "common.h"
+#include "trace.h"
+
+namespace virtual_machine_nsp {
+
+// Compressed trace file layout (host byte order):
+//   compressed_trace_header_tp
+//   chunks, each deflated on its own:
+//     int16_t keyframe[kRegisterNumber]      registers before the first record
+//     encoded records
+//   trace_chunk_index_tp index[chunk_count]
+//   compressed_trace_footer_tp
+// A chunk only depends on its keyframe, so a reader binary searches the
+// index for a cycle and inflates a single chunk.
+//
+// Record encoding, relative to the registers and pc before it:
+//   uint8_t flags       T_MEM_WRITE and the condition codes as in
+//                       trace_record_tp, plus the C_* bits below
+//   [varint pc delta]   C_PC_JUMP: pc is not the previous next pc
+//   [varint inst]       unless C_INST_SEEN: same word as last time at this pc
+//   [varint next delta] C_BRANCH: next pc is not pc + 1
+//   [uint8_t reg_mask, varint value delta per register]   C_REG_WRITE
+//   [varint address delta, varint value]
+// Signed deltas are zigzag encoded before the varint.
+const char kCompressedTraceMagic[8] = {'L', 'C', '3', 'T', 'R', 'C', 'Z', '\0'};
+const uint32_t kCompressedTraceVersion = 2;
+const uint32_t kTraceChunkRecords = 1 << 16;
+
+enum CompressedTraceFlag {
+    C_REG_WRITE = 1 << 0,
+    C_PC_JUMP = 1 << 5,
+    C_BRANCH = 1 << 6,
+    C_INST_SEEN = 1 << 7
+};
+
+struct compressed_trace_header_tp {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_records;
+    uint64_t first_cycle;
+};
+
+struct trace_chunk_index_tp {
+    uint64_t first_cycle;
+    uint64_t offset;
+    uint32_t compressed_size;
+    uint32_t raw_size;
+    uint32_t record_count;
+    uint32_t reserved;
+};
+
+struct compressed_trace_footer_tp {
+    uint64_t index_offset;
+    uint64_t chunk_count;
+    char magic[8];
+};
+
+// Delta encoder of one chunk
+class trace_chunk_encoder_tp {
+    private:
+    register_tp state;
+    uint16_t last_address = 0;
+    // Last instruction word seen at each pc slot, reset per chunk
+    uint16_t seen_pc[256];
+    int16_t seen_inst[256];
+
+    void PutVarint(uint32_t value);
+    void PutSigned(int16_t value);
+
+    public:
+    std::vector<uint8_t> bytes;
+    uint32_t record_count = 0;
+
+    void Begin(const register_tp &keyframe);
+    void Append(const trace_record_tp &record);
+};
+
+// Decode a whole inflated chunk, returns false if it is malformed
+bool DecodeTraceChunk(const uint8_t *data, size_t size, uint32_t record_count, register_tp &keyframe,
+                      std::vector<trace_record_tp> &records);
+
+// Chunks records as they arrive and writes the index on Finish
+class compressed_trace_sink_tp : public trace_sink_tp {
+    private:
+    FILE *file;
+    uint64_t offset;
+    uint64_t next_cycle;
+    register_tp state;
+    trace_chunk_encoder_tp encoder;
+    std::vector<trace_chunk_index_tp> index;
+
+    void FlushChunk();
+
+    public:
+    compressed_trace_sink_tp(FILE *file, uint64_t first_cycle, const register_tp &initial);
+    void Write(const trace_record_tp *records, size_t count) override;
+    void Finish() override;
+};
+
+// Read records [from, from + count) of a compressed trace
+bool ReadCompressedTrace(std::ifstream &in, const std::string &filename, uint64_t from, uint64_t count,
+                         trace_range_tp &range, std::string &error);
+
+}; // virtual machine namespace
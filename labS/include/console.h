@@ -0,0 +1,128 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-14 10:18:52
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-14 10:18:52
+ * @Description  : buffered console behind the traps and device registers
+ */
+#pragma once
+
+#include "common.h"
+#include "replay.h"
+
+namespace virtual_machine_nsp {
+
+// Memory mapped device registers
+const uint16_t kDeviceBase = 0xFE00;
+const uint16_t kKeyboardStatus = 0xFE00;  // KBSR, bit 15: a character is ready
+const uint16_t kKeyboardData = 0xFE02;    // KBDR, reading it takes the character
+const uint16_t kDisplayStatus = 0xFE04;   // DSR, bit 15: the display is ready
+const uint16_t kDisplayData = 0xFE06;     // DDR, writing it prints the low byte
+const uint16_t kMachineControl = 0xFFFE;  // MCR, clearing bit 15 stops the clock
+const int16_t kDeviceReady = int16_t(0x8000);
+// GetChar with a background reader: nothing has arrived yet
+const int kInputPending = -2;
+
+struct input_reader_tp;
+
+// What the program has seen of the console, for reverse execution
+struct console_state_tp {
+    std::string pending_input;
+    size_t input_position = 0;
+    bool input_closed = false;
+    int16_t last_char = 0;
+    uint64_t polls = 0;
+    uint64_t written = 0;
+};
+
+// Input is read a line at a time into a queue. Output is collected and
+// only written out when input is needed, when it grows past
+// kOutputLimit, or on Flush (halt). The streams are not owned.
+// With UseReader a thread reads the input into a lock-free ring instead
+// and no call blocks except WaitForInput. The thread only starts once the
+// program first asks for input.
+class console_tp {
+    private:
+    std::istream *input;
+    std::ostream *output;
+    std::string pending_input;
+    size_t input_position = 0;
+    std::string pending_output;
+    bool input_closed = false;
+    int16_t last_char = 0;
+    // Shared with the reader thread, which may outlive the console
+    std::shared_ptr<input_reader_tp> reader;
+    // Where the reader thread reads from once started, -1 for none
+    int reader_fd = -1;
+    // Input log being recorded or replayed, polls counts FillInput calls
+    replay_tp *replay = nullptr;
+    const uint64_t *clock = nullptr;
+    uint64_t polls = 0;
+    // Characters the program wrote, and how many of them are already out:
+    // after going back in time the program writes them again
+    uint64_t written = 0;
+    uint64_t shown = 0;
+
+    // Blocks for the next line, returns false at end of input (or, with
+    // a reader, when nothing has arrived)
+    bool FillInput();
+    void StartReader();
+
+    public:
+    static const size_t kOutputLimit = 1 << 16;
+
+    explicit console_tp(std::istream *input = &std::cin, std::ostream *output = &std::cout)
+        : input(input), output(output) {}
+    void Attach(std::istream *new_input, std::ostream *new_output);
+    // Read the keyboard from fd on a background thread, from the first
+    // input the program asks for on
+    void UseReader(int fd);
+    // Blocks until a character has arrived or the input is closed
+    void WaitForInput();
+    // Record the input into log, or take it from log instead of any stream
+    void UseReplay(replay_tp *log, const uint64_t *cycle) {
+        replay = log;
+        clock = cycle;
+    }
+
+    // KBSR: waits for a line if none is queued (never waits with a reader)
+    bool InputReady();
+    // Next character, -1 at end of input, kInputPending if a reader has none yet
+    int GetChar();
+    // KBDR: the next character, or the last one again if none is ready
+    int16_t ReadData();
+
+    void Put(char c) {
+        if (written++ < shown) {
+            return;
+        }
+        pending_output += c;
+        if (pending_output.size() >= kOutputLimit) {
+            Flush();
+        }
+    }
+    void Write(const char *text, size_t length) {
+        if (written < shown) {
+            size_t skipped = std::min<uint64_t>(length, shown - written);
+            text += skipped;
+            length -= skipped;
+            written += skipped;
+        }
+        written += length;
+        pending_output.append(text, length);
+        if (pending_output.size() >= kOutputLimit) {
+            Flush();
+        }
+    }
+    void Write(const char *text) {
+        Write(text, strlen(text));
+    }
+    void Flush();
+
+    console_state_tp SaveState() const;
+    // Back to an earlier state: input comes from the replay log up to
+    // where the program had read, output is not written twice
+    void RestoreState(const console_state_tp &state);
+};
+
+}; // virtual machine namespace
@@ -0,0 +1,101 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-22 09:51:18
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-22 09:51:18
+ * @Description  : breakpoints, watchpoints and the interactive prompt
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+#include "observer.h"
+#include "history.h"
+
+namespace virtual_machine_nsp {
+
+// One bit per address of the 64K word space
+class address_bitmap_tp {
+    private:
+    uint64_t words[kVirtualMachineMemorySize / 64] = {};
+    int count = 0;
+
+    public:
+    bool Test(uint16_t address) const {
+        return words[address >> 6] >> (address & 63) & 1;
+    }
+    void Set(uint16_t address) {
+        if (!Test(address)) {
+            words[address >> 6] |= uint64_t(1) << (address & 63);
+            ++count;
+        }
+    }
+    void Clear(uint16_t address) {
+        if (Test(address)) {
+            words[address >> 6] &= ~(uint64_t(1) << (address & 63));
+            --count;
+        }
+    }
+    bool Empty() const {
+        return count == 0;
+    }
+    std::vector<uint16_t> Addresses() const;
+};
+
+// "x3000", "0x3000" or "3000" (hex), "#12288" (decimal)
+bool ParseAddress(const std::string &text, uint16_t &address);
+
+// Stops before an instruction at a breakpoint, before one that reads or
+// writes a watched word, and after every step while stepping, then reads
+// commands from input. Only used when something is set: runs without
+// breakpoints keep the null observer and pay nothing. With a history the
+// prompt can also go back in time.
+struct debug_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    address_bitmap_tp breakpoints;
+    address_bitmap_tp read_watches;
+    address_bitmap_tp write_watches;
+    // Instructions left before the next stop, 0 while continuing
+    uint64_t steps_left = 0;
+    std::istream &input;
+    std::ostream &output;
+    std::string last_command = "step";
+    // Not owned, nullptr without reverse execution
+    history_tp *history = nullptr;
+    // The prompt moved the machine: the next instruction is where it stopped
+    bool skip_next_stop = false;
+    // Set by q: the machine is halted before the instruction it stopped at
+    bool quit = false;
+
+    debug_observer_tp(std::istream &input, std::ostream &output, bool single_step)
+        : steps_left(single_step ? 1 : 0), input(input), output(output) {}
+
+    void BeforeExecute(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) {
+        if (skip_next_stop) {
+            skip_next_stop = false;
+        } else if (steps_left != 0 && --steps_left == 0) {
+            Prompt(vm, pc, inst, "step");
+        } else if (!breakpoints.Empty() && breakpoints.Test(pc)) {
+            Prompt(vm, pc, inst, "breakpoint");
+        } else if (!read_watches.Empty() || !write_watches.Empty()) {
+            CheckWatchpoints(vm, pc, inst);
+        }
+        if (history != nullptr && !vm.restart_step) {
+            history->Record(vm, pc, inst);
+        }
+    }
+    void AfterExecute(virtual_machine_tp &, uint16_t, const instruction_tp &) {}
+
+    // The first watched word inst accesses, false if none
+    bool FindWatch(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst, bool &write,
+                   uint16_t &address) const;
+    void CheckWatchpoints(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst);
+    // Would a breakpoint or watchpoint stop before inst
+    bool WouldStop(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) const;
+    void Announce(uint16_t pc, const instruction_tp &inst, const std::string &reason) const;
+    // Reads commands until one resumes execution
+    void Prompt(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst, const std::string &reason);
+    void PrintHelp() const;
+};
+
+}; // virtual machine namespace
@@ -0,0 +1,115 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-27 15:20:44
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-27 15:20:44
+ * @Description  : GDB remote serial protocol stub
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+#include "observer.h"
+#include "debugger.h"
+
+#include <map>
+
+namespace virtual_machine_nsp {
+
+// Registers as the debugger numbers them: R0-R7, PC, COND, 16 bits each,
+// sent low byte first. Addresses are word addresses; m and M lengths
+// count bytes, two per word, low byte first.
+const int kGdbRegisterCount = 10;
+// How many instructions run between checks for a ^C from the debugger
+const uint64_t kGdbPollInterval = 1 << 16;
+
+// Breakpoint conditions as GDB agent expressions (the X parts of a Z
+// packet), evaluated in the simulator. Returns false if the bytecode uses
+// something unsupported, the caller then stops unconditionally.
+bool EvaluateAgentExpression(const std::string &bytecode, const virtual_machine_tp &vm, int64_t &result);
+
+// Speaks the remote protocol on one connection. As an observer it stops
+// before an instruction with a breakpoint whose condition holds, and after
+// one that accessed a watched word, after a single step or on ^C, and then
+// serves packets until the debugger resumes execution.
+class gdb_stub_tp {
+    private:
+    int listen_fd = -1;
+    int fd = -1;
+    // Unix socket to remove at the end, empty for TCP
+    std::string socket_path;
+    bool no_ack = false;
+    bool detached = false;
+    std::string incoming;
+    // Answer to '?', the reason of the last stop
+    std::string last_stop = "S05";
+    // Instructions left before a step stops, 0 while continuing
+    uint64_t steps_left = 0;
+    uint64_t poll_countdown = kGdbPollInterval;
+    // Watch hit seen before the instruction, reported after it
+    std::string watch_hit;
+    // Conditions per breakpoint address, any of them true stops
+    std::map<uint16_t, std::vector<std::string>> conditions;
+    // Where the last stop resumed: its breakpoint does not stop it again, -1 if none
+    int resume_pc = -1;
+
+    bool ReadPacket(std::string &packet);
+    void SendPacket(const std::string &data);
+    bool InterruptRequested();
+    // Serves packets until one resumes the program, returns false once the debugger is gone
+    bool Serve(virtual_machine_tp &vm, const std::string &stop_reply);
+    std::string HandlePacket(virtual_machine_tp &vm, const std::string &packet, bool &resume);
+    std::string Resume(virtual_machine_tp &vm, char action, const std::string &address, bool &resume);
+    std::string SetPoint(const std::string &packet, bool insert);
+    bool BreakpointHolds(const virtual_machine_tp &vm, uint16_t address);
+
+    public:
+    static constexpr bool kObservesInstructions = true;
+    address_bitmap_tp breakpoints;
+    address_bitmap_tp read_watches;
+    address_bitmap_tp write_watches;
+
+    ~gdb_stub_tp();
+    // "port" listens on 127.0.0.1, anything else is a Unix socket path
+    bool Listen(const std::string &where, std::string &error);
+    // Waits for the debugger and serves it until it starts the program
+    bool Start(virtual_machine_tp &vm);
+    // Reports the end of the program
+    void Exited(virtual_machine_tp &vm);
+
+    void BeforeExecute(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) {
+        if (pc == resume_pc) {
+            resume_pc = -1;
+        } else if (!breakpoints.Empty() && breakpoints.Test(pc) && BreakpointHolds(vm, pc)) {
+            // Stop before the instruction, the engine fetches again from
+            // wherever the debugger resumes
+            vm.reg[R_PC] = pc;
+            vm.restart_step = true;
+            Stop(vm, "T05swbreak:;thread:1;");
+            return;
+        }
+        if (!read_watches.Empty() || !write_watches.Empty()) {
+            CheckWatchpoints(vm, pc, inst);
+        }
+    }
+    void AfterExecute(virtual_machine_tp &vm, uint16_t, const instruction_tp &) {
+        if (detached) {
+            return;
+        }
+        if (steps_left != 0 && --steps_left == 0) {
+            Stop(vm, "T05thread:1;");
+        } else if (!watch_hit.empty()) {
+            Stop(vm, watch_hit);
+        } else if (--poll_countdown == 0) {
+            poll_countdown = kGdbPollInterval;
+            if (InterruptRequested()) {
+                Stop(vm, "T02thread:1;");
+            }
+        }
+    }
+    void CheckWatchpoints(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst);
+    // Takes the reply by value, it may be watch_hit which is cleared here
+    void Stop(virtual_machine_tp &vm, std::string stop_reply);
+};
+
+}; // virtual machine namespace
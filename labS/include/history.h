@@ -0,0 +1,116 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-29 10:12:36
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-29 10:12:36
+ * @Description  : execution history for reverse debugging
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+
+#include <deque>
+#include <functional>
+
+namespace virtual_machine_nsp {
+
+// Snapshots kept before every other one is dropped and the interval doubles
+const size_t kHistorySnapshots = 128;
+
+// The whole machine before the instruction at cycle
+struct machine_state_tp {
+    uint64_t cycle = 0;
+    register_tp reg;
+    std::vector<int16_t> memory;
+    bool user_mode = true;
+    int priority = 0;
+    int16_t saved_ssp = 0;
+    int16_t saved_usp = 0;
+    uint64_t next_event_cycle = UINT64_MAX;
+    event_scheduler_tp events;
+    interrupt_controller_tp interrupts;
+    timer_tp timer;
+    bool keyboard_interrupt_enable = false;
+    bool keyboard_polling = false;
+    bool prompt_shown = false;
+    console_state_tp console;
+};
+
+// Undoes one instruction that only changed registers and at most one
+// memory word, the PC it started at restores the PC
+struct undo_record_tp {
+    uint16_t pc;
+    int16_t cond;
+    int16_t reg_value;
+    uint8_t reg_index;
+    bool wrote;
+    uint16_t address;
+    int16_t word;
+};
+
+// A stop condition of the debugger: the machine is before the instruction at pc
+typedef std::function<bool(virtual_machine_tp &, uint16_t, const instruction_tp &)> stop_predicate_tp;
+
+// Snapshots every interval instructions plus an undo log of the recent
+// instructions. Going back takes the undo log, or the last snapshot before
+// the target and a re-execution from there, so it costs at most about one
+// interval. The program runs deterministically again: input comes from the
+// replay log the machine has to be recording into, output that was already
+// written is dropped. Only the switch engine keeps cycle exact at every
+// instruction, the debugger uses it while recording.
+class history_tp {
+    private:
+    uint64_t interval;
+    std::vector<machine_state_tp> snapshots;
+    // Exact records of the last instructions, the newest one ends at undo_end
+    std::deque<undo_record_tp> undo;
+    uint64_t undo_end = 0;
+
+    void TakeSnapshot(virtual_machine_tp &vm, uint16_t pc);
+    // Restores a snapshot, forgetting everything after it
+    void Restore(virtual_machine_tp &vm, size_t index);
+    // Runs forward to cycle (or the halt), recording. With a predicate,
+    // hit is the last cycle it held at, if any.
+    void RunTo(virtual_machine_tp &vm, uint64_t cycle, const stop_predicate_tp *predicate, bool &found,
+               uint64_t &hit);
+
+    public:
+    explicit history_tp(uint64_t interval) : interval(std::max<uint64_t>(1, interval)) {}
+
+    // Called before each instruction, the machine stands before it at pc
+    void Record(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst);
+    // The first cycle still reachable
+    uint64_t Begin() const {
+        return snapshots.empty() ? 0 : snapshots.front().cycle;
+    }
+    // Moves the machine (standing before an instruction, PC included) to
+    // before the instruction at cycle. Earlier than Begin goes to Begin,
+    // later than the halt stops there. False if it did not reach cycle.
+    bool Goto(virtual_machine_tp &vm, uint64_t cycle);
+    // Goes back to the last cycle before the current one where predicate
+    // holds, or to Begin and returns false
+    bool ReverseFind(virtual_machine_tp &vm, const stop_predicate_tp &predicate);
+};
+
+// Records the history while the machine runs again, checking a predicate
+struct history_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    history_tp &history;
+    const stop_predicate_tp *predicate;
+    bool found = false;
+    uint64_t hit = 0;
+
+    history_observer_tp(history_tp &history, const stop_predicate_tp *predicate)
+        : history(history), predicate(predicate) {}
+    void BeforeExecute(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) {
+        if (predicate != nullptr && (*predicate)(vm, pc, inst)) {
+            found = true;
+            hit = vm.cycle;
+        }
+        history.Record(vm, pc, inst);
+    }
+    void AfterExecute(virtual_machine_tp &, uint16_t, const instruction_tp &) {}
+};
+
+}; // virtual machine namespace
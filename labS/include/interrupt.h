@@ -0,0 +1,94 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-18 16:02:40
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-18 16:02:40
+ * @Description  : device event scheduler and priority interrupt controller
+ */
+#pragma once
+
+#include "common.h"
+
+namespace virtual_machine_nsp {
+
+// Interrupt vector table, one handler address per vector
+const uint16_t kInterruptTable = 0x0100;
+const int kPrivilegeViolation = 0x00;
+const int kKeyboardVector = 0x80;
+const int kTimerVector = 0x81;
+const int kKeyboardPriority = 4;
+const int kTimerPriority = 5;
+
+// Device registers of the timer and the processor status
+const uint16_t kTimerStatus = 0xFE08;      // TMR, bit 15: the interval elapsed (cleared by reading)
+const uint16_t kTimerInterval = 0xFE0A;    // TMI, instructions between timer events, 0 stops the timer
+const uint16_t kProcessorStatus = 0xFFFC;  // PSR, bit 15: user mode, bits 10-8: priority, bits 2-0: NZP
+const int16_t kInterruptEnable = 0x4000;   // IE bit of KBSR and TMR
+const int16_t kInitialSupervisorStack = 0x3000;
+// How often an interrupt enabled keyboard looks for input
+const uint64_t kKeyboardPollInterval = 1000;
+
+enum kEventList {
+    E_TIMER = 0,
+    E_KEYBOARD
+};
+
+struct event_tp {
+    uint64_t cycle;
+    int kind;
+    uint32_t generation;  // stale timer events are dropped
+};
+
+// Device events ordered by the cycle they are due, a binary min-heap
+class event_scheduler_tp {
+    private:
+    std::vector<event_tp> heap;
+
+    public:
+    void Post(uint64_t cycle, int kind, uint32_t generation = 0);
+    // Removes the earliest event if it is due at cycle
+    bool PopDue(uint64_t cycle, event_tp &event);
+    uint64_t NextCycle() const {
+        return heap.empty() ? UINT64_MAX : heap.front().cycle;
+    }
+    bool Empty() const {
+        return heap.empty();
+    }
+    // In heap order, posting them again rebuilds the scheduler
+    const std::vector<event_tp> &Events() const {
+        return heap;
+    }
+};
+
+// One request line per priority level. A request stays pending until the
+// processor runs below its priority.
+class interrupt_controller_tp {
+    private:
+    int pending[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+
+    public:
+    void Raise(int vector, int priority) {
+        pending[priority & 7] = vector;
+    }
+    // Vector requested at level, or -1
+    int Pending(int level) const {
+        return pending[level];
+    }
+    int Acknowledge(int level) {
+        int vector = pending[level];
+        pending[level] = -1;
+        return vector;
+    }
+};
+
+// Interval timer, posts E_TIMER every interval instructions
+struct timer_tp {
+    uint16_t interval = 0;
+    bool interrupt_enable = false;
+    bool expired = false;
+    // The interval was written and is scheduled at the next service point
+    bool reprogrammed = false;
+    uint32_t generation = 0;
+};
+
+}; // virtual machine namespace
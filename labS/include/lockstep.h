@@ -0,0 +1,58 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-11-28 16:02:51
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-11-28 16:02:51
+ * @Description  : lockstep execution of one program over many register sets
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+#include "batch.h"
+
+namespace virtual_machine_nsp {
+
+// 16 lanes of int16_t fill one 256-bit vector register
+const int kLockstepLanes = 16;
+
+// Runs the same image for up to kLockstepLanes initial register files at
+// once. The register file is stored as structure of arrays, so every ALU
+// instruction is one loop over the lanes that the compiler turns into
+// vector code. PC and memory are shared: as long as all lanes branch the
+// same way and store the same values they stay together. Lanes that
+// diverge are split off into a scalar virtual_machine_tp which continues
+// from the diverging instruction, while finished or split lanes are simply
+// masked out of the remaining lockstep work.
+class lockstep_machine_tp {
+    public:
+    alignas(32) int16_t reg[8][kLockstepLanes];
+    alignas(32) int16_t cond[kLockstepLanes];
+    uint16_t pc;
+    uint32_t active;  // lanes still running in lockstep
+    uint64_t steps = 0;
+    memory_tp mem;
+    std::vector<instruction_tp> decode_cache;
+    batch_result_tp result[kLockstepLanes];
+    uint64_t split_lanes = 0;
+
+    lockstep_machine_tp(const memory_tp &image, uint16_t address, const std::vector<register_tp> &lanes);
+    // Run until every lane halted or max_steps instructions were executed
+    void Run(uint64_t max_steps);
+
+    private:
+    int16_t FirstActive(const int16_t *values) const;
+    uint32_t LanesEqual(const int16_t *values, int16_t value) const;
+    // Whether a load or store of some active lane hits a device register
+    bool TouchesDevice(const instruction_tp &inst, const int16_t *base) const;
+    void UpdateCond(int dr);
+    void Finish(uint32_t lanes, bool halted);
+    void Split(uint32_t lanes, uint64_t max_steps);
+};
+
+// Run one program over many register files, kLockstepLanes at a time
+std::vector<batch_result_tp> RunLockstep(const std::string &program, uint16_t address,
+                                         const std::vector<register_tp> &initial, uint64_t max_steps,
+                                         uint64_t *split_lanes = nullptr);
+
+}; // virtual machine namespace
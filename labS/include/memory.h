@@ -5,24 +5,73 @@
  * @LastEditTime : 2021-09-22 20:02:31
  * @Description  : file content
  */
+#pragma once
+
 #include "common.h"
 
 namespace virtual_machine_nsp {
 const int kInstructionLength = 16;
 
+// Decode one line of a memory file: 16 binary digits, possibly followed by
+// anything else, or a hex word such as "x3000", "0x3000" or "3000".
+// Trailing blanks are ignored. Returns false if the line is neither.
+bool TranslateLine(const char *line, size_t length, int16_t &result);
+
 inline int16_t TranslateInstruction(std::string &line) {
-    // TODO: translate hex mode
     int16_t result = 0;
-    if (line.size() == kInstructionLength) {
-        for (int index = 0; index < kInstructionLength; ++index) {
-            result = (result << 1) | (line[index] & 1);
-        }
-    }
+    TranslateLine(line.data(), line.size(), result);
     return result;
 }
 
-const int kVirtualMachineMemorySize = 0xFFFF;
+const int kVirtualMachineMemorySize = 0x10000;
+const int kMemoryPageSize = 0x100;
+const int kMemoryPageCount = kVirtualMachineMemorySize / kMemoryPageSize;
+
+inline int PageIndex(int address) {
+    return (address >> 8) & (kMemoryPageCount - 1);
+}
+
+inline int PageOffset(int address) {
+    return address & (kMemoryPageSize - 1);
+}
+
+// Words of a memory file, one per line. Blank lines are skipped and a
+// trailing '\r' is ignored.
+std::vector<int16_t> ReadWordsFromFile(const std::string &filename);
+// Words of an assembler object file: big endian, the first word is the
+// origin and is not part of the result
+std::vector<int16_t> ReadObjectFile(const std::string &filename, uint16_t &origin);
+
+// A read only memory image shared by many virtual machines. Pages that
+// were never written point at one common zero page.
+class memory_image_tp {
+    private:
+    const int16_t *pages[kMemoryPageCount];
+    std::vector<std::unique_ptr<int16_t[]>> storage;
+    // Keeps external page storage (e.g. a mapped snapshot) alive
+    std::shared_ptr<const void> owner;
+
+    public:
+    // Range loaded from the memory file
+    int image_begin = 0;
+    int image_size = 0;
+
+    memory_image_tp();
+    memory_image_tp(const memory_image_tp &) = delete;
+    memory_image_tp &operator=(const memory_image_tp &) = delete;
+    static std::shared_ptr<const memory_image_tp> FromFile(const std::string &filename, int beginning_address=0x3000);
+    static std::shared_ptr<const memory_image_tp> Empty();
+    static const int16_t *ZeroPage();
 
+    const int16_t *Page(int index) const { return pages[index]; }
+    bool IsZeroPage(int index) const { return pages[index] == ZeroPage(); }
+    int16_t GetContent(int address) const { return pages[PageIndex(address)][PageOffset(address)]; }
+    // Only used while the image is built
+    void SetContent(int address, int16_t value);
+    void SetPage(int index, const int16_t *page, const std::shared_ptr<const void> &page_owner);
+};
+
+// Flat memory: one array per virtual machine, the fastest for a single VM
 class memory_tp {
     private:
     int16_t memory[kVirtualMachineMemorySize];
@@ -32,9 +81,46 @@ class memory_tp {
         memset(memory, 0, sizeof(int16_t) * kVirtualMachineMemorySize);
     }
     // Managements
-    void ReadMemoryFromFile(std::string filename, int beginning_address=0x3000);
-    int16_t GetContent(int address) const;
-    int16_t& operator[](int address);
+    int ReadMemoryFromFile(std::string filename, int beginning_address=0x3000);
+    void LoadImage(const std::shared_ptr<const memory_image_tp> &image);
+    int16_t GetContent(int address) const {
+        return memory[address];
+    }
+    int16_t& operator[](int address) {
+        return memory[address];
+    }
+};
+
+// Copy on write paged memory: reads go to the shared base image until a
+// page is written for the first time, which gives the VM a private copy.
+// Thousands of VMs running the same image only pay for the pages they
+// actually modify.
+class paged_memory_tp {
+    private:
+    std::shared_ptr<const memory_image_tp> base;
+    const int16_t *read_pages[kMemoryPageCount];
+    std::unique_ptr<int16_t[]> private_pages[kMemoryPageCount];
+
+    void CopyPage(int index);
+
+    public:
+    paged_memory_tp();
+    paged_memory_tp(const paged_memory_tp &other);
+    paged_memory_tp &operator=(const paged_memory_tp &other);
+    // Managements
+    int ReadMemoryFromFile(std::string filename, int beginning_address=0x3000);
+    void LoadImage(const std::shared_ptr<const memory_image_tp> &image);
+    int PrivatePageCount() const;
+    int16_t GetContent(int address) const {
+        return read_pages[PageIndex(address)][PageOffset(address)];
+    }
+    int16_t& operator[](int address) {
+        int index = PageIndex(address);
+        if (private_pages[index] == nullptr) {
+            CopyPage(index);
+        }
+        return private_pages[index][PageOffset(address)];
+    }
 };
 
-}; // virtual machine nsp
\ No newline at end of file
+}; // virtual machine nsp
@@ -0,0 +1,108 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-11-26 10:12:40
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-11-26 10:12:40
+ * @Description  : observer policies for the execution core
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+
+namespace virtual_machine_nsp {
+
+// Every observer is called around each executed instruction by
+// basic_virtual_machine_tp::NextStep<Observer> and Run<Observer>, on either
+// memory policy. The debuggers (debugger.h, gdb_stub.h) only watch the flat
+// memory virtual_machine_tp. Observers that need to see single instructions
+// set kObservesInstructions, which keeps the threaded engine from running
+// superinstructions.
+
+// Calls visitor.Fetch, Read and Write for every memory access inst is about
+// to make, in order. Must run before the instruction, while the registers
+// still hold its operands. LDI and STI read their pointer word first. Native
+// PUTS and PUTSP read their string exactly as NativeTrap does, any other
+// trap reads its entry of the trap vector table.
+template <typename Machine, typename Visitor>
+inline void VisitAccesses(Machine &vm, uint16_t pc, const instruction_tp &inst, Visitor &visitor) {
+    visitor.Fetch(pc);
+    uint16_t address;
+    switch (inst.opcode) {
+        case O_LD:  visitor.Read(vm.reg[R_PC] + inst.imm); break;
+        case O_LDR: visitor.Read(vm.reg[inst.sr1] + inst.imm); break;
+        case O_ST:  visitor.Write(vm.reg[R_PC] + inst.imm); break;
+        case O_STR: visitor.Write(vm.reg[inst.sr1] + inst.imm); break;
+        case O_LDI:
+        case O_STI:
+        address = vm.reg[R_PC] + inst.imm;
+        visitor.Read(address);
+        address = vm.mem.GetContent(address);
+        if (inst.opcode == O_LDI) {
+            visitor.Read(address);
+        } else {
+            visitor.Write(address);
+        }
+        break;
+        case O_TRAP:
+        if (vm.trap_mode == M_NATIVE && inst.imm >= 0x20 && inst.imm <= 0x25) {
+            if (inst.imm != 0x22 && inst.imm != 0x24) {
+                break;
+            }
+            // PUTS ends at a zero word, PUTSP also at a zero high byte
+            address = vm.reg[R_R0];
+            for (int count = 0; count < kMaxTrapString; ++count) {
+                visitor.Read(address);
+                int16_t value = vm.mem.GetContent(address++);
+                if (value == 0 || (inst.imm == 0x24 && (value >> 8 & 0xFF) == 0)) {
+                    break;
+                }
+            }
+        } else {
+            visitor.Read(inst.imm);
+        }
+        break;
+        default: break;
+    }
+}
+
+// Production runs: no instrumentation code at all
+struct null_observer_tp {
+    static constexpr bool kObservesInstructions = false;
+    template <typename Machine> void BeforeExecute(Machine &, uint16_t, const instruction_tp &) {}
+    template <typename Machine> void AfterExecute(Machine &, uint16_t, const instruction_tp &) {}
+};
+
+// Detailed mode (-d): opcode, jump operands and registers after each step
+struct detail_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    std::ostream &file;
+
+    explicit detail_observer_tp(std::ostream &file) : file(file) {}
+    template <typename Machine> void BeforeExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+    template <typename Machine> void AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+};
+
+// Executed instructions per opcode
+struct counting_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    uint64_t opcode_count[16] = {};
+
+    template <typename Machine> void BeforeExecute(Machine &, uint16_t, const instruction_tp &inst) {
+        ++opcode_count[inst.opcode];
+    }
+    template <typename Machine> void AfterExecute(Machine &, uint16_t, const instruction_tp &) {}
+    void PrintReport(std::ostream &os) const;
+};
+
+// One "pc: instruction" line per step
+struct tracing_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    std::ostream &os;
+
+    explicit tracing_observer_tp(std::ostream &os) : os(os) {}
+    template <typename Machine> void BeforeExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+    template <typename Machine> void AfterExecute(Machine &, uint16_t, const instruction_tp &) {}
+};
+
+}; // virtual machine namespace
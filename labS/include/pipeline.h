@@ -0,0 +1,120 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-12 14:26:08
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-12 14:26:08
+ * @Description  : five stage pipeline timing model and branch predictors
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+
+namespace virtual_machine_nsp {
+
+// Direction predictor of conditional BR, asked before and told after
+class branch_predictor_tp {
+    public:
+    virtual ~branch_predictor_tp() {}
+    virtual bool Predict(uint16_t pc, uint16_t target) = 0;
+    virtual void Update(uint16_t pc, bool taken) = 0;
+};
+
+// Backward taken, forward not taken
+class static_predictor_tp : public branch_predictor_tp {
+    public:
+    bool Predict(uint16_t pc, uint16_t target) override { return target <= pc; }
+    void Update(uint16_t, bool) override {}
+};
+
+// 2-bit saturating counters indexed by pc
+class bimodal_predictor_tp : public branch_predictor_tp {
+    private:
+    static const int kTableSize = 1024;
+    uint8_t counter[kTableSize];
+
+    public:
+    bimodal_predictor_tp() { std::fill(counter, counter + kTableSize, 1); }
+    bool Predict(uint16_t pc, uint16_t) override { return counter[pc % kTableSize] >= 2; }
+    void Update(uint16_t pc, bool taken) override {
+        uint8_t &entry = counter[pc % kTableSize];
+        entry = taken ? std::min(entry + 1, 3) : std::max(entry - 1, 0);
+    }
+};
+
+// 2-bit counters indexed by pc xor global history
+class gshare_predictor_tp : public branch_predictor_tp {
+    private:
+    static const int kHistoryBits = 10;
+    static const int kTableSize = 1 << kHistoryBits;
+    uint8_t counter[kTableSize];
+    uint32_t history = 0;
+
+    int Index(uint16_t pc) const { return (pc ^ history) & (kTableSize - 1); }
+
+    public:
+    gshare_predictor_tp() { std::fill(counter, counter + kTableSize, 1); }
+    bool Predict(uint16_t pc, uint16_t) override { return counter[Index(pc)] >= 2; }
+    void Update(uint16_t pc, bool taken) override {
+        uint8_t &entry = counter[Index(pc)];
+        entry = taken ? std::min(entry + 1, 3) : std::max(entry - 1, 0);
+        history = (history << 1) | taken;
+    }
+};
+
+// static, bimodal (2-bit) or gshare, nullptr for an unknown name
+std::unique_ptr<branch_predictor_tp> MakeBranchPredictor(const std::string &name);
+
+struct pipeline_config_tp {
+    // Cycles each opcode spends in EX/MEM, 1 never stalls
+    uint64_t latency[16] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 1, 1, 1, 1};
+    uint64_t load_use_penalty = 1;
+    uint64_t mispredict_penalty = 2;
+};
+
+// "LDI=3,TRAP=10" overrides of the per opcode latencies
+bool ParseOpcodeLatencies(const std::string &text, pipeline_config_tp &config, std::string &error);
+
+// --pipeline: cycles of an in-order IF ID EX MEM WB pipeline with full
+// forwarding. On top of one cycle per instruction and the initial fill it
+// charges
+//   load use stalls  an instruction reading the register or condition codes
+//                    loaded by the instruction right before it
+//   latency stalls   opcodes configured to take more than one cycle
+//   mispredictions   BR against the direction predictor, JSR, JSRR and JMP
+//                    against a branch target buffer, RET (JMP R7) against a
+//                    return address stack
+struct pipeline_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    static const int kStageCount = 5;
+    static const int kTargetBufferSize = 256;
+    static const int kReturnStackSize = 8;
+    // Register number of the condition codes in the hazard masks
+    static const int kCondBit = 8;
+
+    pipeline_config_tp config;
+    std::unique_ptr<branch_predictor_tp> predictor;
+    uint64_t instructions = 0;
+    uint64_t load_use_stalls = 0;
+    uint64_t latency_stalls = 0;
+    uint64_t branch_count = 0, branch_mispredicts = 0;
+    uint64_t jump_count = 0, jump_mispredicts = 0;
+    uint64_t return_count = 0, return_mispredicts = 0;
+    // Registers the previous instruction loaded from memory
+    uint32_t loaded = 0;
+    uint16_t target_buffer_pc[kTargetBufferSize] = {};
+    uint16_t target_buffer[kTargetBufferSize] = {};
+    uint16_t return_stack[kReturnStackSize] = {};
+    int return_top = 0;
+
+    pipeline_observer_tp(const pipeline_config_tp &config, std::unique_ptr<branch_predictor_tp> predictor)
+        : config(config), predictor(std::move(predictor)) {}
+    template <typename Machine> void BeforeExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+    template <typename Machine> void AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+    // Looks target up in the branch target buffer and records it there
+    bool PredictTarget(uint16_t pc, uint16_t target);
+    uint64_t Cycles() const;
+    void PrintReport(std::ostream &os) const;
+};
+
+}; // virtual machine namespace
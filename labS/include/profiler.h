@@ -0,0 +1,183 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-07 21:03:12
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-07 21:03:12
+ * @Description  : execution profiler
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+#include "observer.h"
+
+#include <unordered_map>
+
+namespace virtual_machine_nsp {
+
+// A loop found from a taken backward branch: header <= end
+struct profile_loop_tp {
+    uint16_t header;
+    uint16_t end;
+    uint64_t iterations;
+    uint64_t cycles;
+};
+
+// --profile: executions per address and per opcode, taken and not taken
+// counts of every BR and hot loops from back edges. All counters are flat
+// arrays indexed by address, so a step costs a few increments.
+struct profile_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    // About 1.7MB, allocate it on the heap
+    uint64_t pc_count[kVirtualMachineMemorySize] = {};
+    uint64_t taken_count[kVirtualMachineMemorySize] = {};
+    uint64_t back_edge_count[kVirtualMachineMemorySize] = {};
+    uint16_t back_edge_target[kVirtualMachineMemorySize] = {};
+    uint64_t opcode_count[16] = {};
+
+    template <typename Machine> void BeforeExecute(Machine &, uint16_t pc, const instruction_tp &inst) {
+        ++pc_count[pc];
+        ++opcode_count[inst.opcode];
+    }
+    template <typename Machine> void AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst) {
+        if (inst.opcode == O_BR) {
+            uint16_t target = vm.reg[R_PC];
+            if (target != uint16_t(pc + 1)) {
+                ++taken_count[pc];
+                if (target <= pc) {
+                    ++back_edge_count[pc];
+                    back_edge_target[pc] = target;
+                }
+            }
+        }
+    }
+
+    // Loops sorted by the cycles spent inside them
+    std::vector<profile_loop_tp> Loops() const;
+    template <typename Machine> void PrintReport(std::ostream &os, Machine &vm, size_t top = 20);
+    // One "frame;frame;... count" line per address, frames are the loops
+    // around it from the outermost in
+    void WriteFoldedStacks(std::ostream &os);
+};
+
+// A subroutine is named by its entry address
+struct call_frame_tp {
+    uint16_t function;
+    uint16_t call_site;
+    uint16_t return_address;
+    uint64_t entry_cycle;
+};
+
+struct call_edge_tp {
+    uint16_t caller;
+    uint16_t call_site;
+    uint16_t callee;
+    uint64_t calls;
+    uint64_t inclusive;
+};
+
+// --call-graph: inclusive and exclusive instructions per subroutine from a
+// shadow call stack. JSR and JSRR push a frame. Any JMP to the return
+// address of a frame on the stack pops down to that frame, which covers
+// RET as well as returns through other registers and unwinding several
+// frames at once. Recursive frames only add to the inclusive count of the
+// outermost activation.
+struct call_graph_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    std::vector<call_frame_tp> stack;
+    uint64_t cycle = 0;
+    int current = 0;
+    // Instructions per address, charged to owner[address]. Addresses run by
+    // more than one subroutine spill the others into shared_cost.
+    uint64_t pc_count[kVirtualMachineMemorySize] = {};
+    int owner[kVirtualMachineMemorySize];
+    std::unordered_map<uint32_t, uint64_t> shared_cost;
+    uint64_t calls[kVirtualMachineMemorySize] = {};
+    uint64_t inclusive[kVirtualMachineMemorySize] = {};
+    uint32_t active[kVirtualMachineMemorySize] = {};
+    std::unordered_map<uint64_t, call_edge_tp> edges;
+
+    // About 2.5MB, allocate it on the heap
+    explicit call_graph_observer_tp(uint16_t entry);
+    template <typename Machine> void BeforeExecute(Machine &, uint16_t pc, const instruction_tp &) {
+        ++cycle;
+        if (owner[pc] == current) {
+            ++pc_count[pc];
+        } else {
+            Charge(pc);
+        }
+    }
+    template <typename Machine> void AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst) {
+        if (inst.opcode == O_JSR) {
+            Call(pc, vm.reg[R_PC]);
+        } else if (inst.opcode == O_JMP && stack.size() > 1) {
+            Return(vm.reg[R_PC]);
+        }
+    }
+
+    void Charge(uint16_t pc);
+    void Call(uint16_t call_site, uint16_t target);
+    void Return(uint16_t target);
+    void PopFrame();
+    // Close the frames still open when the program halted
+    void Finish();
+    void PrintReport(std::ostream &os, size_t top = 20) const;
+    void WriteCallgrind(std::ostream &os, const std::string &program) const;
+};
+
+// --memory-profile: fetches, data reads and data writes per word, and the
+// working set over a sliding window of instructions. Data accesses are
+// worked out from the instruction before it runs, like the hardware would
+// issue them. LDI and STI also read their pointer word, and PUTS reads its
+// string. The working set is sampled every window instructions as the
+// words and pages touched during the last window instructions.
+struct memory_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    uint64_t fetch_count[kVirtualMachineMemorySize] = {};
+    uint64_t read_count[kVirtualMachineMemorySize] = {};
+    uint64_t write_count[kVirtualMachineMemorySize] = {};
+    // Cycle of the last access plus one, 0 for never
+    uint64_t last_touch[kVirtualMachineMemorySize] = {};
+    uint64_t cycle = 0;
+    uint64_t window;
+    uint64_t next_sample;
+
+    struct sample_tp {
+        uint64_t cycle;
+        uint32_t words;
+        uint32_t pages;
+    };
+    std::vector<sample_tp> working_set;
+
+    // About 2MB, allocate it on the heap
+    explicit memory_observer_tp(uint64_t window) : window(window), next_sample(window) {}
+    void Read(uint16_t address) {
+        ++read_count[address];
+        last_touch[address] = cycle;
+    }
+    void Write(uint16_t address) {
+        ++write_count[address];
+        last_touch[address] = cycle;
+    }
+    void Fetch(uint16_t address) {
+        ++fetch_count[address];
+        last_touch[address] = cycle;
+    }
+    template <typename Machine> void BeforeExecute(Machine &vm, uint16_t pc, const instruction_tp &inst) {
+        ++cycle;
+        VisitAccesses(vm, pc, inst, *this);
+        if (cycle == next_sample) {
+            Sample();
+        }
+    }
+    template <typename Machine> void AfterExecute(Machine &, uint16_t, const instruction_tp &) {}
+
+    void Sample();
+    // Summary of the busiest pages
+    void PrintReport(std::ostream &os, size_t top = 16) const;
+    // prefix.csv (per word), prefix-pages.csv, prefix-working-set.csv and
+    // prefix.pgm, a 256x256 image with one pixel per word and one row per page
+    bool WriteFiles(const std::string &prefix) const;
+};
+
+}; // virtual machine namespace
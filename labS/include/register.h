@@ -25,4 +25,7 @@ namespace virtual_machine_nsp {
     
     typedef std::array<int16_t, kRegisterNumber> register_tp;
     std::ostream& operator<<(std::ostream& os, const register_tp& reg);
+    // R0-R7 from a register file, all zero unless it has at least 8 lines.
+    // PC and COND are zero.
+    register_tp ReadRegisterFile(const std::string &regfile);
 } // virtual machine namespace
\ No newline at end of file
@@ -0,0 +1,75 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-20 14:37:05
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-20 14:37:05
+ * @Description  : record and replay of console input and interrupts
+ */
+#pragma once
+
+#include "common.h"
+
+namespace virtual_machine_nsp {
+
+// Replay log layout, one event per line:
+//   input <cycle> <poll> <bytes in hex>   input that arrived at a console poll
+//   closed <cycle> <poll>                 end of input
+//   interrupt <cycle> <vector>            a device interrupt was taken
+// A poll is one attempt of the console to fetch more input (KBSR, KBDR,
+// GETC, IN or a keyboard interrupt poll with nothing queued). Input is
+// matched by poll number, the cycle is where the VM stood. Recording and
+// replaying always run the switch engine, whose cycle is exact at every
+// instruction. Interrupts follow from the input and the timer and are
+// only compared to find where a replay diverged.
+const char kReplayHeader[] = "# lc3 replay log 1";
+
+struct replay_input_tp {
+    uint64_t cycle;
+    uint64_t poll;
+    std::string data;
+};
+
+struct replay_interrupt_tp {
+    uint64_t cycle;
+    int vector;
+};
+
+class replay_tp {
+    public:
+    bool recording = true;
+    std::vector<replay_input_tp> inputs;
+    std::vector<replay_interrupt_tp> interrupts;
+    bool has_closed = false;
+    uint64_t closed_cycle = 0;
+    uint64_t closed_poll = 0;
+    // Polls answered while recording, later ones read the input again
+    // after the debugger went back in time
+    uint64_t live_polls = 0;
+    // Next interrupt to take (to compare with, when replaying) and the
+    // first one that did not match
+    size_t interrupt_position = 0;
+    bool diverged = false;
+    uint64_t diverged_cycle = 0;
+
+    void RecordInput(uint64_t cycle, uint64_t poll, const char *data, size_t length) {
+        inputs.push_back(replay_input_tp{cycle, poll, std::string(data, length)});
+    }
+    void RecordClosed(uint64_t cycle, uint64_t poll) {
+        has_closed = true;
+        closed_cycle = cycle;
+        closed_poll = poll;
+    }
+    // Input recorded at poll, false if there was none. Past the end of
+    // a replayed log the input counts as closed.
+    bool ReplayInput(uint64_t poll, std::string &data, bool &closed) const;
+    // Records the interrupt, or compares it with the log when replaying.
+    // Interrupts already logged are only counted.
+    void Interrupt(uint64_t cycle, int vector);
+    // The machine went back to cycle: the interrupts after it are to come
+    void Rewind(uint64_t cycle);
+
+    bool Save(const std::string &filename) const;
+    bool Load(const std::string &filename, std::string &error);
+};
+
+}; // virtual machine namespace
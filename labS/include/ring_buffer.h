@@ -0,0 +1,65 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-03 19:42:10
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-03 19:42:10
+ * @Description  : lock-free single producer single consumer ring buffer
+ */
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+
+namespace virtual_machine_nsp {
+
+// One thread pushes, one other thread pops. Head and tail only ever grow
+// and are masked on access, so the capacity must be a power of two. Each
+// side keeps a cached copy of the other side's index to avoid touching the
+// shared cache line on every call.
+template <typename T>
+class spsc_ring_buffer_tp {
+    private:
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};   // next slot to pop
+    size_t cached_tail = 0;
+    alignas(64) std::atomic<size_t> tail{0};   // next slot to push
+    size_t cached_head = 0;
+
+    public:
+    explicit spsc_ring_buffer_tp(size_t capacity) : slots(capacity), mask(capacity - 1) {}
+
+    bool TryPush(const T &value) {
+        size_t current = tail.load(std::memory_order_relaxed);
+        if (current - cached_head == slots.size()) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (current - cached_head == slots.size()) {
+                return false;
+            }
+        }
+        slots[current & mask] = value;
+        tail.store(current + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Pop up to count values into out, returns how many were popped
+    size_t TryPop(T *out, size_t count) {
+        size_t current = head.load(std::memory_order_relaxed);
+        if (cached_tail == current) {
+            cached_tail = tail.load(std::memory_order_acquire);
+        }
+        size_t available = std::min(count, cached_tail - current);
+        for (size_t index = 0; index < available; ++index) {
+            out[index] = slots[(current + index) & mask];
+        }
+        head.store(current + available, std::memory_order_release);
+        return available;
+    }
+
+    bool Empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+}; // virtual machine namespace
@@ -10,6 +10,8 @@
 #include "common.h"
 #include "register.h"
 #include "memory.h"
+#include "console.h"
+#include "interrupt.h"
 
 namespace virtual_machine_nsp {
 
@@ -34,34 +36,201 @@ enum kOpcodeList {
 enum kTrapRoutineList {
 };
 
-class virtual_machine_tp {
+// Superinstructions executed by the threaded engine as a single handler
+enum kFusionList {
+    F_NONE = 0,
+    F_LOAD_IMM,     // AND Rx, Rx, #0 ; ADD Rx, Rx, #imm
+    F_ADD_BR,       // ADD ; BR (loop back edges)
+    F_LDR_ADD_STR,  // LDR Rx, Rb, #o ; ADD Rx, ... ; STR Rx, Rb, #o
+    kFusionCount
+};
+
+extern const char *kFusionName[kFusionCount];
+const int kFusionHotThreshold = 64;
+
+extern const char *kOpcodeName[16];
+
+// An instruction with all of its fields extracted once, so the handlers
+// never have to shift, mask or sign extend the raw word again.
+struct instruction_tp {
+    int16_t inst;
+    int16_t imm;     // sign extended imm5 / offset6 / PCoffset9 / PCoffset11, zero extended trapvect8
+    uint8_t opcode;
+    uint8_t dr;      // bits [11:9]: DR, SR of stores, nzp of BR
+    uint8_t sr1;     // bits [8:6]: SR1, BaseR
+    uint8_t sr2;     // bits [2:0]
+    bool flag;       // bit [5] for ADD/AND, bit [11] for JSR
+    uint8_t dispatch; // threaded engine handler: the opcode, or 16 + fusion - 1
+    uint8_t length;   // words executed by the dispatch handler, 0 marks an empty cache slot
+    uint16_t hits;    // taken back edges, used to find hot loops
+};
+
+// How TRAP is serviced: natively for the vectors of the standard service
+// routines, or always through the trap vector table of a loaded OS image
+enum kTrapModeList {
+    M_NATIVE = 0,
+    M_OS
+};
+
+// Run engines, picked with --engine
+enum kEngineList {
+    ENGINE_SWITCH = 0,
+    ENGINE_THREADED
+};
+
+const int kDecodeCacheSize = 0x10000;
+// Words PUTS and PUTSP read at most: once around the memory
+const int kMaxTrapString = kVirtualMachineMemorySize;
+
+// The virtual machine, parameterised on its memory policy: memory_tp is
+// one flat array, paged_memory_tp shares a read only image between many
+// machines and copies pages on their first write.
+template <typename Memory>
+class basic_virtual_machine_tp {
     public:
     register_tp reg;
-    memory_tp mem;
+    Memory mem;
+    // Predecoded instructions keyed by address: one flat array for the flat
+    // memory, allocated when the machine first runs (PrepareDecode), pages
+    // allocated on first use for paged memory so its many machines only pay
+    // for the code they run
+    static constexpr bool kPagedDecode = std::is_same<Memory, paged_memory_tp>::value;
+    std::unique_ptr<instruction_tp[]> decode_cache;
+    std::unique_ptr<instruction_tp[]> decode_pages[kPagedDecode ? kMemoryPageCount : 1];
+    // Words loaded from the memory file
+    uint16_t image_begin = 0;
+    int image_size = 0;
+    // Superinstruction statistics: fused sites and executions per fusion
+    uint64_t fusion_sites[kFusionCount] = {};
+    uint64_t fusion_count[kFusionCount] = {};
+    // Console behind the trap routines and the device registers
+    console_tp console;
+    // Set once a HALT (or a zero word) has been executed
+    bool halted = false;
+    int trap_mode = M_NATIVE;
+    // Processor status and the stack pointer of the mode not running
+    bool user_mode = true;
+    int priority = 0;
+    int16_t saved_ssp = kInitialSupervisorStack;
+    int16_t saved_usp = 0;
+    // Executed instructions. The engines leave their fast paths once cycle
+    // reaches next_event_cycle, 0 asks them to stop after the current
+    // instruction (a device write, RTI or a halt).
+    uint64_t cycle = 0;
+    uint64_t next_event_cycle = UINT64_MAX;
+    event_scheduler_tp events;
+    interrupt_controller_tp interrupts;
+    timer_tp timer;
+    bool keyboard_interrupt_enable = false;
+    bool keyboard_polling = false;
+    // When GETC/IN find no input on a console with a reader thread: wait
+    // inside the trap, or (yield_on_input) stall and return to the host,
+    // which waits and runs again. The stalled trap is not counted but is
+    // seen by observers, so only hosts without one should yield.
+    bool yield_on_input = false;
+    bool input_wait = false;
+    bool prompt_shown = false;
+    // Set by an observer that moved or halted the machine from
+    // BeforeExecute: the engines drop the fetched instruction
+    bool restart_step = false;
+    // Input and interrupt log (see replay.h), not owned
+    replay_tp *replay = nullptr;
     
     // Instructions
-    void VM_ADD(int16_t inst);
-    void VM_AND(int16_t inst);
-    void VM_BR(int16_t inst);
-    void VM_JMP(int16_t inst);
-    void VM_JSR(int16_t inst);
-    void VM_LD(int16_t inst);
-    void VM_LDI(int16_t inst);
-    void VM_LDR(int16_t inst);
-    void VM_LEA(int16_t inst);
-    void VM_NOT(int16_t inst);
-    void VM_RTI(int16_t inst);
-    void VM_ST(int16_t inst);
-    void VM_STI(int16_t inst);
-    void VM_STR(int16_t inst);
-    void VM_TRAP(int16_t inst);
+    void VM_ADD(const instruction_tp &inst);
+    void VM_AND(const instruction_tp &inst);
+    void VM_BR(const instruction_tp &inst);
+    void VM_JMP(const instruction_tp &inst);
+    void VM_JSR(const instruction_tp &inst);
+    void VM_LD(const instruction_tp &inst);
+    void VM_LDI(const instruction_tp &inst);
+    void VM_LDR(const instruction_tp &inst);
+    void VM_LEA(const instruction_tp &inst);
+    void VM_NOT(const instruction_tp &inst);
+    void VM_RTI(const instruction_tp &inst);
+    void VM_ST(const instruction_tp &inst);
+    void VM_STI(const instruction_tp &inst);
+    void VM_STR(const instruction_tp &inst);
+    void VM_TRAP(const instruction_tp &inst);
+    bool NativeTrap(int vector);
+    // Character for GETC/IN, false if the trap stalls
+    bool ReadTrapInput(int &c);
+
+    // Decoding
+    static instruction_tp Decode(int16_t inst);
+    // Allocate the flat decode cache, done on entry to the engines so their
+    // fetch does not test for it
+    void PrepareDecode() {
+        if (!kPagedDecode && decode_cache == nullptr) {
+            decode_cache.reset(new instruction_tp[kDecodeCacheSize]());
+        }
+    }
+    instruction_tp &DecodeSlot(uint16_t address) {
+        if (!kPagedDecode) {
+            return decode_cache[address];
+        }
+        std::unique_ptr<instruction_tp[]> &page = decode_pages[PageIndex(address)];
+        if (page == nullptr) {
+            page.reset(new instruction_tp[kMemoryPageSize]());
+        }
+        return page[PageOffset(address)];
+    }
+    // The decode entries of the page holding address, nullptr if none yet
+    instruction_tp *DecodePage(uint16_t address) {
+        if (!kPagedDecode) {
+            return decode_cache == nullptr ? nullptr : decode_cache.get() + (address - PageOffset(address));
+        }
+        return decode_pages[PageIndex(address)].get();
+    }
+    const instruction_tp &FetchDecoded(uint16_t address);
+    void InvalidateDecoded(uint16_t address);
+    // Data accesses, the only ones that reach the device registers
+    int16_t LoadMemory(uint16_t address) {
+        if (address >= kDeviceBase) {
+            return ReadDevice(address);
+        }
+        return mem.GetContent(address);
+    }
+    void StoreMemory(uint16_t address, int16_t value);
+    int16_t ReadDevice(uint16_t address);
+    // Returns false for device page words that behave like memory
+    bool WriteDevice(uint16_t address, int16_t value);
+
+    // Interrupts
+    int16_t ProcessorStatus() const;
+    void SetProcessorStatus(int16_t psr);
+    void TakeInterrupt(int vector, int new_priority);
+    // Run the due device events and take the highest pending interrupt
+    void ServiceEvents();
+    void UseReplay(replay_tp *log) {
+        replay = log;
+        console.UseReplay(log, &cycle);
+    }
+
+    // Superinstructions
+    int FuseAt(uint16_t address);
+    void FuseRange(uint16_t begin, uint16_t end);
+    void PrintFusionReport(std::ostream &os) const;
 
     // Managements
-    virtual_machine_tp() {}
-    virtual_machine_tp(const int16_t address, const std::string &memfile, const std::string &regfile);
+    basic_virtual_machine_tp() {}
+    basic_virtual_machine_tp(const int16_t address, const std::string &memfile, const std::string &regfile);
+    basic_virtual_machine_tp(const int16_t address, const std::shared_ptr<const memory_image_tp> &image,
+                             const std::string &regfile);
+    // Load an OS image (text memory file at x0000 or .obj) holding the trap vector table
+    bool LoadOperatingSystem(const std::string &filename);
     void UpdateCondRegister(int reg);
     void SetReg(const register_tp &new_reg);
     int16_t NextStep();
+    uint64_t Run(uint64_t max_steps);
+    // Execution core specialised on an observer policy (see observer.h)
+    template <typename Observer> int16_t NextStep(Observer &observer);
+    template <typename Observer> void RunSwitch(uint64_t end, Observer &observer);
+    template <typename Observer> uint64_t Run(uint64_t max_steps, Observer &observer);
+    template <typename Observer> uint64_t RunThreaded(uint64_t max_steps, Observer &observer);
 };
 
+typedef basic_virtual_machine_tp<memory_tp> virtual_machine_tp;
+typedef basic_virtual_machine_tp<paged_memory_tp> paged_virtual_machine_tp;
+
 }; // virtual machine namespace
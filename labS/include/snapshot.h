@@ -0,0 +1,77 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-01 20:31:17
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-01 20:31:17
+ * @Description  : binary snapshots of the virtual machine
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+
+namespace virtual_machine_nsp {
+
+// Snapshot file layout (host byte order):
+//   snapshot_header_tp
+//   uint32_t page_offset[kMemoryPageCount]   file offset of each page, 0 for a zero page
+//   event_tp events[event_count]             pending device events
+//   pages, kMemoryPageSize words each, from the first multiple of
+//   kSnapshotDataOffset that follows the events
+// The page data starts on an OS page boundary, so a restored image can
+// point straight into the mapped file and the kernel only reads the pages
+// the program touches.
+const char kSnapshotMagic[8] = {'L', 'C', '3', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t kSnapshotVersion = 2;
+const uint32_t kSnapshotDataOffset = 0x1000;
+
+struct snapshot_header_tp {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_count;
+    uint64_t cycle;
+    int16_t reg[kRegisterNumber];
+    uint16_t image_begin;
+    int32_t image_size;
+    // Processor status and the stack pointer of the mode not running
+    int16_t psr;
+    int16_t saved_ssp;
+    int16_t saved_usp;
+    // Devices and interrupts
+    uint16_t timer_interval;
+    uint32_t timer_generation;
+    uint8_t timer_interrupt_enable;
+    uint8_t timer_expired;
+    uint8_t timer_reprogrammed;
+    uint8_t keyboard_interrupt_enable;
+    uint8_t keyboard_polling;
+    int32_t pending_vector[8];
+    uint64_t next_event_cycle;
+    uint32_t event_count;
+};
+
+struct snapshot_tp {
+    std::shared_ptr<const memory_image_tp> image;
+    register_tp reg;
+    uint64_t cycle = 0;
+    bool user_mode = true;
+    int priority = 0;
+    int16_t saved_ssp = kInitialSupervisorStack;
+    int16_t saved_usp = 0;
+    timer_tp timer;
+    bool keyboard_interrupt_enable = false;
+    bool keyboard_polling = false;
+    interrupt_controller_tp interrupts;
+    event_scheduler_tp events;
+    uint64_t next_event_cycle = UINT64_MAX;
+};
+
+template <typename Machine>
+bool SaveSnapshot(const std::string &filename, const Machine &virtual_machine, uint64_t cycle);
+// Map a snapshot file, its memory image stays backed by the mapping
+bool LoadSnapshot(const std::string &filename, snapshot_tp &snapshot, std::string &error);
+// Registers, cycle, processor and device state of a machine built on the snapshot image
+template <typename Machine>
+void RestoreSnapshot(Machine &virtual_machine, const snapshot_tp &snapshot);
+
+}; // virtual machine namespace
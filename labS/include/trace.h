@@ -0,0 +1,143 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-03 19:42:10
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-03 19:42:10
+ * @Description  : binary execution trace written by a background thread
+ */
+#pragma once
+
+#include "common.h"
+#include "simulator.h"
+#include "ring_buffer.h"
+
+#include <thread>
+
+namespace virtual_machine_nsp {
+
+// Plain trace file layout (host byte order):
+//   trace_header_tp                 cycle and registers before the first instruction
+//   trace_record_tp ...             one per executed instruction
+// The record at index i was executed at cycle first_cycle + i. The
+// compressed container is described in compressed_trace.h.
+const char kTraceMagic[8] = {'L', 'C', '3', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t kTraceVersion = 3;
+
+struct trace_header_tp {
+    char magic[8];
+    uint32_t version;
+    uint64_t first_cycle;
+    int16_t reg[kRegisterNumber];
+};
+
+enum TraceFlag {
+    T_MEM_WRITE = 2,
+    // bits 2-4 hold the condition register after the instruction
+    T_COND_SHIFT = 2
+};
+
+#pragma pack(push, 1)
+struct trace_record_tp {
+    uint16_t pc;
+    int16_t inst;
+    int16_t next_pc;
+    uint16_t mem_address;
+    int16_t mem_value;
+    // Bit i set: R_i changed, its new value is reg_value[i]
+    uint8_t reg_mask;
+    uint8_t flags;
+    int16_t reg_value[R_R7 + 1];
+};
+#pragma pack(pop)
+
+// Registers after the instruction of record
+inline void ApplyTraceRecord(register_tp &reg, const trace_record_tp &record) {
+    for (int index = R_R0; index <= R_R7; ++index) {
+        if (record.reg_mask & (1 << index)) {
+            reg[index] = record.reg_value[index];
+        }
+    }
+    reg[R_COND] = (record.flags >> T_COND_SHIFT) & 0x7;
+    reg[R_PC] = record.next_pc;
+}
+
+// Where the writer thread puts the records, called from that thread only
+class trace_sink_tp {
+    public:
+    virtual ~trace_sink_tp() {}
+    virtual void Write(const trace_record_tp *records, size_t count) = 0;
+    // Write whatever is buffered and close the file
+    virtual void Finish() = 0;
+};
+
+// trace_header_tp followed by the records as they are
+class plain_trace_sink_tp : public trace_sink_tp {
+    private:
+    FILE *file;
+
+    public:
+    plain_trace_sink_tp(FILE *file, uint64_t first_cycle, const register_tp &initial);
+    void Write(const trace_record_tp *records, size_t count) override;
+    void Finish() override;
+};
+
+// Owns the trace sink and the thread draining the ring buffer into it.
+// Push blocks only while the ring is full, so no record is ever dropped.
+class trace_writer_tp {
+    private:
+    std::unique_ptr<trace_sink_tp> sink;
+    spsc_ring_buffer_tp<trace_record_tp> ring;
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+    bool closed = false;
+
+    void Drain();
+
+    public:
+    static const size_t kRingCapacity = 1 << 16;
+
+    explicit trace_writer_tp(std::unique_ptr<trace_sink_tp> sink);
+    ~trace_writer_tp();
+    // Plain or compressed trace of a run starting at first_cycle
+    static std::unique_ptr<trace_writer_tp> Open(const std::string &filename, uint64_t first_cycle,
+                                                 const register_tp &initial, bool compressed);
+
+    void Push(const trace_record_tp &record) {
+        while (!ring.TryPush(record)) {
+            std::this_thread::yield();
+        }
+    }
+    // Flush everything pushed so far and close the file
+    void Close();
+};
+
+// --binary-trace: one trace_record_tp per executed instruction. Registers
+// are compared with the previous record, so what an interrupt entry did to
+// them between two instructions shows up in the record after it.
+struct binary_trace_observer_tp {
+    static constexpr bool kObservesInstructions = true;
+    trace_writer_tp &writer;
+    // Registers as the records so far leave them
+    register_tp traced;
+    uint16_t store_address = 0;
+
+    binary_trace_observer_tp(trace_writer_tp &writer, const register_tp &initial)
+        : writer(writer), traced(initial) {}
+    template <typename Machine> void BeforeExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+    template <typename Machine> void AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst);
+};
+
+// Records of a trace from some cycle on, with the registers before it
+struct trace_range_tp {
+    uint64_t first_cycle = 0;
+    register_tp state;
+    std::vector<trace_record_tp> records;
+};
+
+// Read count records of a plain or compressed trace starting at cycle
+// from. Plain traces are read from the start, compressed ones seek to the
+// chunk holding from. Returns false with a message on error.
+bool ReadTrace(const std::string &filename, uint64_t from, uint64_t count, trace_range_tp &range,
+               std::string &error);
+
+}; // virtual machine namespace
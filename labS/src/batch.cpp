@@ -0,0 +1,164 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-11-27 14:20:05
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-11-27 14:20:05
+ * @Description  : batch runner for many independent virtual machines
+ */
+#include "batch.h"
+
+#include <bitset>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+namespace virtual_machine_nsp {
+    const uint64_t kBatchRunSlice = 1 << 20;
+
+    work_stealing_pool_tp::work_stealing_pool_tp(size_t thread_count) {
+        if (thread_count == 0) {
+            thread_count = 1;
+        }
+        for (size_t index = 0; index < thread_count; ++index) {
+            queues.emplace_back(new worker_queue_tp());
+        }
+    }
+
+    bool work_stealing_pool_tp::PopLocal(size_t worker, size_t &task) {
+        std::lock_guard<std::mutex> guard(queues[worker]->lock);
+        if (queues[worker]->tasks.empty()) {
+            return false;
+        }
+        task = queues[worker]->tasks.back();
+        queues[worker]->tasks.pop_back();
+        return true;
+    }
+
+    bool work_stealing_pool_tp::Steal(size_t thief, size_t &task) {
+        for (size_t distance = 1; distance < queues.size(); ++distance) {
+            worker_queue_tp &victim = *queues[(thief + distance) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work_stealing_pool_tp::Run(size_t count, const std::function<void(size_t)> &task) {
+        // Deal the tasks out round robin, nothing is added while running
+        for (size_t index = 0; index < count; ++index) {
+            queues[index % queues.size()]->tasks.push_back(index);
+        }
+        std::vector<std::thread> workers;
+        for (size_t worker = 0; worker < queues.size(); ++worker) {
+            workers.emplace_back([this, worker, &task]() {
+                size_t current;
+                while (PopLocal(worker, current) || Steal(worker, current)) {
+                    task(current);
+                }
+            });
+        }
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    std::vector<batch_job_tp> ReadBatchManifest(const std::string &filename) {
+        std::vector<batch_job_tp> jobs;
+        std::ifstream in(filename);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            batch_job_tp job;
+            if (!(fields >> job.program) || job.program[0] == '#') {
+                continue;
+            }
+            fields >> job.register_file >> job.input_file;
+            jobs.push_back(job);
+        }
+        return jobs;
+    }
+
+    batch_result_tp RunBatchJob(const batch_job_tp &job, const std::shared_ptr<const memory_image_tp> &image,
+                                int16_t address, uint64_t max_steps) {
+        batch_result_tp result;
+        if (image == nullptr) {
+            result.error = "cannot open " + job.program;
+            return result;
+        }
+        // Jobs of the same program share its image and only copy the pages they write
+        std::unique_ptr<paged_virtual_machine_tp> virtual_machine(
+            new paged_virtual_machine_tp(address, image, job.register_file));
+
+        // Trap routines read from the job's input file, their output is dropped
+        std::ifstream input_file;
+        std::istringstream no_input;
+        std::ostringstream output;
+        if (!job.input_file.empty()) {
+            input_file.open(job.input_file);
+            virtual_machine->console.Attach(&input_file, &output);
+        } else {
+            virtual_machine->console.Attach(&no_input, &output);
+        }
+
+        virtual_machine->FuseRange(virtual_machine->image_begin,
+                                   virtual_machine->image_begin + virtual_machine->image_size);
+        while (!virtual_machine->halted && result.cycles < max_steps) {
+            result.cycles += virtual_machine->Run(std::min(kBatchRunSlice, max_steps - result.cycles));
+            virtual_machine->console.Flush();
+            output.str("");
+        }
+        result.reg = virtual_machine->reg;
+        result.halted = virtual_machine->halted;
+        return result;
+    }
+
+    void WriteBatchResult(std::ostream &out, size_t index, const std::string &name, const batch_result_tp &result) {
+        out << std::dec << index << ' ' << name << ' ';
+        if (!result.error.empty()) {
+            out << "error " << result.error << '\n';
+            return;
+        }
+        out << (result.halted ? "halted" : "timeout") << " cycle=" << result.cycles;
+        out << std::hex << std::setfill('0');
+        for (int reg = R_R0; reg <= R_R7; ++reg) {
+            out << " R" << reg << '=' << std::setw(4) << uint16_t(result.reg[reg]);
+        }
+        out << " PC=" << std::setw(4) << uint16_t(result.reg[R_PC]);
+        out << " COND=" << std::bitset<3>(result.reg[R_COND]) << std::setfill(' ') << std::dec << '\n';
+    }
+
+    int RunBatch(const std::string &manifest, const std::string &results, size_t thread_count,
+                 int16_t address, uint64_t max_steps) {
+        std::vector<batch_job_tp> jobs = ReadBatchManifest(manifest);
+        std::vector<batch_result_tp> job_results(jobs.size());
+
+        // Every program is read once, whatever the number of jobs using it
+        std::map<std::string, std::shared_ptr<const memory_image_tp>> images;
+        std::vector<std::shared_ptr<const memory_image_tp>> job_images;
+        for (const batch_job_tp &job : jobs) {
+            if (images.count(job.program) == 0) {
+                images[job.program] = std::ifstream(job.program).good()
+                                          ? memory_image_tp::FromFile(job.program, address)
+                                          : nullptr;
+            }
+            job_images.push_back(images[job.program]);
+        }
+
+        work_stealing_pool_tp pool(thread_count);
+        pool.Run(jobs.size(), [&](size_t index) {
+            job_results[index] = RunBatchJob(jobs[index], job_images[index], address, max_steps);
+        });
+
+        std::ofstream out(results);
+        int failed = 0;
+        for (size_t index = 0; index < jobs.size(); ++index) {
+            WriteBatchResult(out, index, jobs[index].program, job_results[index]);
+            failed += !job_results[index].error.empty();
+        }
+        return failed;
+    }
+}; // virtual machine namespace
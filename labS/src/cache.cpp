@@ -0,0 +1,178 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-10 16:47:35
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-10 16:47:35
+ * @Description  : guest memory cache model
+ */
+#include "cache.h"
+
+#include <iomanip>
+
+namespace virtual_machine_nsp {
+    static bool IsPowerOfTwo(int value) {
+        return value > 0 && (value & (value - 1)) == 0;
+    }
+
+    bool ParseCacheConfig(const std::string &text, cache_config_tp &config, std::string &error) {
+        std::vector<std::string> fields;
+        std::stringstream stream(text);
+        std::string field;
+        while (std::getline(stream, field, ':')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 3) {
+            error = "cache \"" + text + "\": expected size:ways:line[:lru|fifo][:wb|wt]";
+            return false;
+        }
+        try {
+            config.size = std::stoi(fields[0]);
+            config.ways = std::stoi(fields[1]);
+            config.line = std::stoi(fields[2]);
+        } catch (const std::exception &) {
+            error = "cache \"" + text + "\": size, ways and line must be numbers";
+            return false;
+        }
+        for (size_t index = 3; index < fields.size(); ++index) {
+            if (fields[index] == "lru" || fields[index] == "fifo") {
+                config.lru = fields[index] == "lru";
+            } else if (fields[index] == "wb" || fields[index] == "wt") {
+                config.write_back = fields[index] == "wb";
+            } else {
+                error = "cache \"" + text + "\": unknown option " + fields[index];
+                return false;
+            }
+        }
+        if (!IsPowerOfTwo(config.size) || !IsPowerOfTwo(config.ways) || !IsPowerOfTwo(config.line) ||
+            config.line * config.ways > config.size || config.size > kVirtualMachineMemorySize) {
+            error = "cache \"" + text + "\": sizes must be powers of two with line * ways <= size <= 65536";
+            return false;
+        }
+        return true;
+    }
+
+    bool ParseCacheLatency(const std::string &text, cache_config_tp &l1, cache_config_tp &l2, uint64_t &memory,
+                           std::string &error) {
+        std::stringstream stream(text);
+        char first = 0, second = 0;
+        if (!(stream >> l1.latency >> first >> l2.latency >> second >> memory) || first != ':' || second != ':' ||
+            !stream.eof()) {
+            error = "cache latency \"" + text + "\": expected l1:l2:memory";
+            return false;
+        }
+        return true;
+    }
+
+    cache_tp::cache_tp(const cache_config_tp &config, cache_tp *next, uint64_t memory_latency)
+        : config(config), next(next), memory_latency(memory_latency) {
+        set_count = config.size / (config.line * config.ways);
+        line_shift = 0;
+        while ((1 << line_shift) < config.line) {
+            ++line_shift;
+        }
+        lines.resize(config.size / config.line, line_tp{0, false, false, 0});
+    }
+
+    uint64_t cache_tp::Below(uint16_t address, bool write) {
+        return next ? next->Access(address, write) : memory_latency;
+    }
+
+    uint64_t cache_tp::Access(uint16_t address, bool write) {
+        ++clock;
+        (write ? stats.writes : stats.reads)++;
+        uint16_t number = address >> line_shift;
+        line_tp *set = &lines[(number % set_count) * config.ways];
+        uint16_t tag = number / set_count;
+
+        for (int way = 0; way < config.ways; ++way) {
+            line_tp &line = set[way];
+            if (line.valid && line.tag == tag) {
+                last_missed = false;
+                if (config.lru) {
+                    line.stamp = clock;
+                }
+                if (write && config.write_back) {
+                    line.dirty = true;
+                    return config.latency;
+                }
+                if (write) {
+                    // Write through, the next level sees every write
+                    Below(address, true);
+                }
+                return config.latency;
+            }
+        }
+
+        last_missed = true;
+        (write ? stats.write_misses : stats.read_misses)++;
+        if (write && !config.write_back) {
+            // No write allocate
+            return config.latency + Below(address, true);
+        }
+        line_tp *victim = set;
+        for (int way = 0; way < config.ways; ++way) {
+            if (!set[way].valid) {
+                victim = &set[way];
+                break;
+            }
+            if (set[way].stamp < victim->stamp) {
+                victim = &set[way];
+            }
+        }
+        uint64_t latency = config.latency;
+        if (victim->valid && victim->dirty) {
+            ++stats.writebacks;
+            latency += Below(uint16_t((victim->tag * set_count + number % set_count) << line_shift), true);
+        }
+        latency += Below(address, false);
+        *victim = line_tp{tag, true, write, clock};
+        return latency;
+    }
+
+    cache_observer_tp::cache_observer_tp(const cache_config_tp &l1_config, const cache_config_tp *l2_config,
+                                         uint64_t memory_latency) {
+        if (l2_config != nullptr) {
+            l2.reset(new cache_tp(*l2_config, nullptr, memory_latency));
+        }
+        l1.reset(new cache_tp(l1_config, l2.get(), memory_latency));
+    }
+
+    static void PrintLevel(std::ostream &os, const char *name, const cache_tp &cache) {
+        const cache_config_tp &config = cache.Config();
+        const cache_stats_tp &stats = cache.stats;
+        uint64_t accesses = stats.reads + stats.writes;
+        uint64_t misses = stats.read_misses + stats.write_misses;
+        os << name << ": " << config.size << " words, " << config.ways << " ways, " << config.line
+           << " word lines, " << (config.lru ? "LRU" : "FIFO") << ", "
+           << (config.write_back ? "write back" : "write through") << std::endl;
+        os << "  " << accesses << " accesses, " << misses << " misses (" << stats.read_misses << " read, "
+           << stats.write_misses << " write), " << stats.writebacks << " write backs, hit rate "
+           << (accesses == 0 ? 0.0 : 100.0 * (accesses - misses) / accesses) << "%" << std::endl;
+    }
+
+    void cache_observer_tp::PrintReport(std::ostream &os, size_t top) const {
+        os << std::dec << std::fixed << std::setprecision(2);
+        PrintLevel(os, "L1", *l1);
+        if (l2) {
+            PrintLevel(os, "L2", *l2);
+        }
+        std::vector<uint16_t> addresses;
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            if (pc_misses[address] != 0) {
+                addresses.push_back(address);
+            }
+        }
+        std::sort(addresses.begin(), addresses.end(),
+                  [this](uint16_t a, uint16_t b) { return pc_misses[a] > pc_misses[b]; });
+        os << "L1 misses per pc:" << std::endl;
+        for (size_t index = 0; index < addresses.size() && index < top; ++index) {
+            uint16_t address = addresses[index];
+            os << "  x" << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << address
+               << std::dec << std::nouppercase << std::setfill(' ') << std::setw(12) << pc_misses[address]
+               << " / " << std::left << std::setw(12) << pc_accesses[address] << std::right << std::setw(8)
+               << 100.0 * (pc_accesses[address] - pc_misses[address]) / pc_accesses[address] << "% hits"
+               << std::endl;
+        }
+        os << std::defaultfloat;
+    }
+}; // virtual machine namespace
@@ -0,0 +1,280 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-05 15:20:44
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-05 15:20:44
+ * @Description  : chunked, delta encoded trace container with a seek index
+ */
+#include "compressed_trace.h"
+
+#include <zlib.h>
+
+namespace virtual_machine_nsp {
+    static uint16_t ZigZag(int16_t value) {
+        return uint16_t((value << 1) ^ (value >> 15));
+    }
+
+    static int16_t UnZigZag(uint16_t value) {
+        return int16_t((value >> 1) ^ -(value & 1));
+    }
+
+    void trace_chunk_encoder_tp::PutVarint(uint32_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(uint8_t(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(uint8_t(value));
+    }
+
+    void trace_chunk_encoder_tp::PutSigned(int16_t value) {
+        PutVarint(ZigZag(value));
+    }
+
+    void trace_chunk_encoder_tp::Begin(const register_tp &keyframe) {
+        state = keyframe;
+        last_address = 0;
+        bytes.clear();
+        record_count = 0;
+        // Slot i can only hold a pc with low byte i, so this marks all empty
+        std::fill(seen_pc, seen_pc + 256, 1);
+        seen_pc[1] = 0;
+        const uint8_t *raw = reinterpret_cast<const uint8_t *>(keyframe.data());
+        bytes.insert(bytes.end(), raw, raw + sizeof(int16_t) * kRegisterNumber);
+    }
+
+    void trace_chunk_encoder_tp::Append(const trace_record_tp &record) {
+        uint8_t flags = record.flags & (T_MEM_WRITE | (0x7 << T_COND_SHIFT));
+        int slot = record.pc & 0xFF;
+        bool jump = record.pc != uint16_t(state[R_PC]);
+        bool branch = uint16_t(record.next_pc) != uint16_t(record.pc + 1);
+        bool seen = seen_pc[slot] == record.pc && seen_inst[slot] == record.inst;
+        flags |= (record.reg_mask != 0 ? C_REG_WRITE : 0) | (jump ? C_PC_JUMP : 0) | (branch ? C_BRANCH : 0) |
+                 (seen ? C_INST_SEEN : 0);
+        bytes.push_back(flags);
+        if (jump) {
+            PutSigned(int16_t(record.pc - state[R_PC]));
+        }
+        if (!seen) {
+            PutVarint(uint16_t(record.inst));
+            seen_pc[slot] = record.pc;
+            seen_inst[slot] = record.inst;
+        }
+        if (branch) {
+            PutSigned(int16_t(record.next_pc - (record.pc + 1)));
+        }
+        if (record.reg_mask != 0) {
+            bytes.push_back(record.reg_mask);
+            for (int index = R_R0; index <= R_R7; ++index) {
+                if (record.reg_mask & (1 << index)) {
+                    PutSigned(int16_t(record.reg_value[index] - state[index]));
+                }
+            }
+        }
+        if (record.flags & T_MEM_WRITE) {
+            PutSigned(int16_t(record.mem_address - last_address));
+            PutSigned(record.mem_value);
+            last_address = record.mem_address;
+        }
+        ApplyTraceRecord(state, record);
+        ++record_count;
+    }
+
+    bool DecodeTraceChunk(const uint8_t *data, size_t size, uint32_t record_count, register_tp &keyframe,
+                          std::vector<trace_record_tp> &records) {
+        const uint8_t *end = data + size;
+        bool ok = true;
+        auto get_byte = [&]() -> uint8_t {
+            if (data == end) {
+                ok = false;
+                return 0;
+            }
+            return *data++;
+        };
+        auto get_varint = [&]() -> uint16_t {
+            uint32_t value = 0;
+            for (int shift = 0; shift < 21; shift += 7) {
+                uint8_t byte = get_byte();
+                value |= uint32_t(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            return uint16_t(value);
+        };
+        auto get_signed = [&]() -> int16_t {
+            return UnZigZag(get_varint());
+        };
+
+        if (size < sizeof(int16_t) * kRegisterNumber) {
+            return false;
+        }
+        memcpy(keyframe.data(), data, sizeof(int16_t) * kRegisterNumber);
+        data += sizeof(int16_t) * kRegisterNumber;
+
+        register_tp state = keyframe;
+        uint16_t last_address = 0;
+        uint16_t seen_pc[256];
+        int16_t seen_inst[256] = {};
+        std::fill(seen_pc, seen_pc + 256, 1);
+        seen_pc[1] = 0;
+        records.reserve(records.size() + record_count);
+        for (uint32_t index = 0; index < record_count && ok; ++index) {
+            trace_record_tp record = {};
+            uint8_t flags = get_byte();
+            record.flags = flags & (T_MEM_WRITE | (0x7 << T_COND_SHIFT));
+            record.pc = state[R_PC];
+            if (flags & C_PC_JUMP) {
+                record.pc += get_signed();
+            }
+            int slot = record.pc & 0xFF;
+            if (flags & C_INST_SEEN) {
+                record.inst = seen_inst[slot];
+            } else {
+                record.inst = get_varint();
+                seen_pc[slot] = record.pc;
+                seen_inst[slot] = record.inst;
+            }
+            record.next_pc = record.pc + 1;
+            if (flags & C_BRANCH) {
+                record.next_pc += get_signed();
+            }
+            if (flags & C_REG_WRITE) {
+                record.reg_mask = get_byte();
+                for (int index = R_R0; index <= R_R7; ++index) {
+                    if (record.reg_mask & (1 << index)) {
+                        record.reg_value[index] = state[index] + get_signed();
+                    }
+                }
+            }
+            if (flags & T_MEM_WRITE) {
+                record.mem_address = last_address + get_signed();
+                record.mem_value = get_signed();
+                last_address = record.mem_address;
+            }
+            ApplyTraceRecord(state, record);
+            records.push_back(record);
+        }
+        return ok;
+    }
+
+    compressed_trace_sink_tp::compressed_trace_sink_tp(FILE *file, uint64_t first_cycle, const register_tp &initial)
+        : file(file), next_cycle(first_cycle), state(initial) {
+        compressed_trace_header_tp header = {};
+        memcpy(header.magic, kCompressedTraceMagic, sizeof(header.magic));
+        header.version = kCompressedTraceVersion;
+        header.chunk_records = kTraceChunkRecords;
+        header.first_cycle = first_cycle;
+        fwrite(&header, sizeof(header), 1, file);
+        offset = sizeof(header);
+        encoder.Begin(state);
+    }
+
+    void compressed_trace_sink_tp::FlushChunk() {
+        if (encoder.record_count == 0) {
+            return;
+        }
+        uLongf compressed_size = compressBound(encoder.bytes.size());
+        std::vector<uint8_t> compressed(compressed_size);
+        compress2(compressed.data(), &compressed_size, encoder.bytes.data(), encoder.bytes.size(), Z_BEST_SPEED);
+        fwrite(compressed.data(), 1, compressed_size, file);
+
+        trace_chunk_index_tp entry = {};
+        entry.first_cycle = next_cycle;
+        entry.offset = offset;
+        entry.compressed_size = compressed_size;
+        entry.raw_size = encoder.bytes.size();
+        entry.record_count = encoder.record_count;
+        index.push_back(entry);
+
+        offset += compressed_size;
+        next_cycle += encoder.record_count;
+        encoder.Begin(state);
+    }
+
+    void compressed_trace_sink_tp::Write(const trace_record_tp *records, size_t count) {
+        for (size_t index = 0; index < count; ++index) {
+            encoder.Append(records[index]);
+            ApplyTraceRecord(state, records[index]);
+            if (encoder.record_count == kTraceChunkRecords) {
+                FlushChunk();
+            }
+        }
+    }
+
+    void compressed_trace_sink_tp::Finish() {
+        FlushChunk();
+        compressed_trace_footer_tp footer = {};
+        footer.index_offset = offset;
+        footer.chunk_count = index.size();
+        memcpy(footer.magic, kCompressedTraceMagic, sizeof(footer.magic));
+        fwrite(index.data(), sizeof(trace_chunk_index_tp), index.size(), file);
+        fwrite(&footer, sizeof(footer), 1, file);
+        fclose(file);
+    }
+
+    bool ReadCompressedTrace(std::ifstream &in, const std::string &filename, uint64_t from, uint64_t count,
+                             trace_range_tp &range, std::string &error) {
+        compressed_trace_header_tp header;
+        compressed_trace_footer_tp footer;
+        in.seekg(0);
+        in.read(reinterpret_cast<char *>(&header), sizeof(header));
+        in.seekg(-std::streamoff(sizeof(footer)), std::ios::end);
+        in.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+        if (!in || header.version != kCompressedTraceVersion ||
+            memcmp(footer.magic, kCompressedTraceMagic, sizeof(footer.magic)) != 0) {
+            error = filename + " is truncated or of an unsupported version";
+            return false;
+        }
+        std::vector<trace_chunk_index_tp> index(footer.chunk_count);
+        in.seekg(footer.index_offset);
+        in.read(reinterpret_cast<char *>(index.data()), sizeof(trace_chunk_index_tp) * index.size());
+        if (!in) {
+            error = filename + ": cannot read the chunk index";
+            return false;
+        }
+
+        from = std::max(from, header.first_cycle);
+        range.first_cycle = from;
+        range.records.clear();
+        // Last chunk starting at or before from
+        auto chunk = std::upper_bound(index.begin(), index.end(), from,
+            [](uint64_t cycle, const trace_chunk_index_tp &entry) { return cycle < entry.first_cycle; });
+        if (chunk != index.begin()) {
+            --chunk;
+        }
+
+        bool have_state = false;
+        std::vector<uint8_t> compressed, raw;
+        std::vector<trace_record_tp> records;
+        for (; chunk != index.end() && range.records.size() < count; ++chunk) {
+            compressed.resize(chunk->compressed_size);
+            raw.resize(chunk->raw_size);
+            in.seekg(chunk->offset);
+            in.read(reinterpret_cast<char *>(compressed.data()), compressed.size());
+            uLongf raw_size = raw.size();
+            register_tp keyframe;
+            records.clear();
+            if (!in || uncompress(raw.data(), &raw_size, compressed.data(), compressed.size()) != Z_OK ||
+                !DecodeTraceChunk(raw.data(), raw_size, chunk->record_count, keyframe, records)) {
+                error = filename + ": corrupt chunk at offset " + std::to_string(chunk->offset);
+                return false;
+            }
+            size_t begin = 0;
+            if (!have_state) {
+                // Replay the head of the first chunk up to from
+                range.state = keyframe;
+                for (; begin < records.size() && chunk->first_cycle + begin < from; ++begin) {
+                    ApplyTraceRecord(range.state, records[begin]);
+                }
+                have_state = true;
+            }
+            size_t end = std::min<uint64_t>(records.size(), begin + (count - range.records.size()));
+            range.records.insert(range.records.end(), records.begin() + begin, records.begin() + end);
+        }
+        if (!have_state) {
+            // Empty trace, or from is past its end
+            range.state = {};
+        }
+        return true;
+    }
+}; // virtual machine namespace
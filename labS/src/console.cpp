@@ -0,0 +1,199 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-14 10:18:52
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-14 10:18:52
+ * @Description  : buffered console behind the traps and device registers
+ */
+#include "console.h"
+#include "ring_buffer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+namespace virtual_machine_nsp {
+    const size_t kReaderCapacity = 1 << 16;
+
+    struct input_reader_tp {
+        spsc_ring_buffer_tp<char> ring{kReaderCapacity};
+        std::atomic<bool> closed{false};
+        std::mutex mutex;
+        std::condition_variable arrived;
+
+        void Notify() {
+            // Taking the lock orders the push before a waiter's check
+            { std::lock_guard<std::mutex> lock(mutex); }
+            arrived.notify_all();
+        }
+    };
+
+    static void ReadInput(std::shared_ptr<input_reader_tp> reader, int fd) {
+        char buffer[4096];
+        while (true) {
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            if (length <= 0) {
+                break;
+            }
+            for (ssize_t index = 0; index < length; ++index) {
+                while (!reader->ring.TryPush(buffer[index])) {
+                    // The program is not reading, wait for room
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            reader->Notify();
+        }
+        reader->closed = true;
+        reader->Notify();
+    }
+
+    void console_tp::Attach(std::istream *new_input, std::ostream *new_output) {
+        Flush();
+        reader.reset();
+        reader_fd = -1;
+        input = new_input;
+        output = new_output;
+        pending_input.clear();
+        input_position = 0;
+        input_closed = false;
+    }
+
+    void console_tp::UseReader(int fd) {
+        reader.reset();
+        reader_fd = fd;
+        pending_input.clear();
+        input_position = 0;
+        input_closed = false;
+    }
+
+    void console_tp::StartReader() {
+        reader = std::make_shared<input_reader_tp>();
+        // Detached: it may sit in read() until the process exits
+        std::thread(ReadInput, reader, reader_fd).detach();
+    }
+
+    void console_tp::WaitForInput() {
+        // Input the log already holds does not wait
+        if (reader == nullptr || (replay != nullptr && polls < replay->live_polls)) {
+            return;
+        }
+        Flush();
+        std::unique_lock<std::mutex> lock(reader->mutex);
+        reader->arrived.wait(lock, [this] { return !reader->ring.Empty() || reader->closed; });
+    }
+
+    bool console_tp::FillInput() {
+        if (input_closed) {
+            return false;
+        }
+        uint64_t poll = polls++;
+        if (replay != nullptr && (!replay->recording || poll < replay->live_polls)) {
+            if (!replay->ReplayInput(poll, pending_input, input_closed)) {
+                return false;
+            }
+            input_position = 0;
+            return true;
+        }
+        if (replay != nullptr) {
+            replay->live_polls = polls;
+        }
+        if (reader == nullptr && reader_fd >= 0) {
+            StartReader();
+        }
+        if (reader != nullptr) {
+            if (!pending_output.empty()) {
+                Flush();
+            }
+            char buffer[256];
+            size_t count = reader->ring.TryPop(buffer, sizeof(buffer));
+            if (count == 0) {
+                // Closed is set after the last push
+                input_closed = reader->closed && reader->ring.Empty();
+                if (input_closed && replay != nullptr) {
+                    replay->RecordClosed(*clock, poll);
+                }
+                return false;
+            }
+            pending_input.assign(buffer, count);
+            input_position = 0;
+            if (replay != nullptr) {
+                replay->RecordInput(*clock, poll, buffer, count);
+            }
+            return true;
+        }
+        // Whoever waits for input should see the prompt first
+        Flush();
+        std::string line;
+        if (!std::getline(*input, line)) {
+            input_closed = true;
+            if (replay != nullptr) {
+                replay->RecordClosed(*clock, poll);
+            }
+            return false;
+        }
+        if (!input->eof()) {
+            line += '\n';
+        }
+        pending_input = line;
+        input_position = 0;
+        if (replay != nullptr) {
+            replay->RecordInput(*clock, poll, line.data(), line.size());
+        }
+        return true;
+    }
+
+    bool console_tp::InputReady() {
+        return input_position < pending_input.size() || FillInput();
+    }
+
+    int console_tp::GetChar() {
+        if (!InputReady()) {
+            // A replay stalls wherever the recorded run had to wait
+            return input_closed || (reader == nullptr && replay == nullptr) ? -1 : kInputPending;
+        }
+        last_char = uint8_t(pending_input[input_position++]);
+        return last_char;
+    }
+
+    int16_t console_tp::ReadData() {
+        if (input_position < pending_input.size()) {
+            last_char = uint8_t(pending_input[input_position++]);
+        }
+        return last_char;
+    }
+
+    console_state_tp console_tp::SaveState() const {
+        console_state_tp state;
+        state.pending_input = pending_input;
+        state.input_position = input_position;
+        state.input_closed = input_closed;
+        state.last_char = last_char;
+        state.polls = polls;
+        state.written = written;
+        return state;
+    }
+
+    void console_tp::RestoreState(const console_state_tp &state) {
+        shown = std::max(shown, written);
+        pending_input = state.pending_input;
+        input_position = state.input_position;
+        input_closed = state.input_closed;
+        last_char = state.last_char;
+        polls = state.polls;
+        written = state.written;
+    }
+
+    void console_tp::Flush() {
+        if (!pending_output.empty()) {
+            output->write(pending_output.data(), pending_output.size());
+            pending_output.clear();
+        }
+        output->flush();
+    }
+}; // virtual machine namespace
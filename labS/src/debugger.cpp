@@ -0,0 +1,276 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-22 09:51:18
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-22 09:51:18
+ * @Description  : breakpoints, watchpoints and the interactive prompt
+ */
+#include "debugger.h"
+
+#include <iomanip>
+
+namespace virtual_machine_nsp {
+    static std::string Hex(uint16_t value) {
+        std::ostringstream os;
+        os << 'x' << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << value;
+        return os.str();
+    }
+
+    std::vector<uint16_t> address_bitmap_tp::Addresses() const {
+        std::vector<uint16_t> result;
+        for (int index = 0; index < kVirtualMachineMemorySize / 64; ++index) {
+            for (uint64_t bits = words[index]; bits != 0; bits &= bits - 1) {
+                result.push_back(index * 64 + __builtin_ctzll(bits));
+            }
+        }
+        return result;
+    }
+
+    bool ParseAddress(const std::string &text, uint16_t &address) {
+        if (text.empty()) {
+            return false;
+        }
+        int base = 16;
+        size_t start = 0;
+        if (text[0] == '#') {
+            base = 10;
+            start = 1;
+        } else if (text[0] == 'x' || text[0] == 'X') {
+            start = 1;
+        } else if (text.size() > 1 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+            start = 2;
+        }
+        if (start == text.size()) {
+            return false;
+        }
+        char *end = nullptr;
+        unsigned long value = strtoul(text.c_str() + start, &end, base);
+        if (*end != '\0' || value > 0xFFFF) {
+            return false;
+        }
+        address = value;
+        return true;
+    }
+
+    // Finds the first watched word among the accesses of one instruction
+    struct watch_visitor_tp {
+        const debug_observer_tp &debugger;
+        bool hit = false;
+        bool write = false;
+        uint16_t address = 0;
+
+        explicit watch_visitor_tp(const debug_observer_tp &debugger) : debugger(debugger) {}
+        void Fetch(uint16_t) {}
+        void Read(uint16_t target) {
+            if (!hit && debugger.read_watches.Test(target)) {
+                hit = true;
+                address = target;
+            }
+        }
+        void Write(uint16_t target) {
+            if (!hit && debugger.write_watches.Test(target)) {
+                hit = true;
+                write = true;
+                address = target;
+            }
+        }
+    };
+
+    bool debug_observer_tp::FindWatch(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst, bool &write,
+                                      uint16_t &address) const {
+        watch_visitor_tp visitor(*this);
+        VisitAccesses(vm, pc, inst, visitor);
+        write = visitor.write;
+        address = visitor.address;
+        return visitor.hit;
+    }
+
+    void debug_observer_tp::CheckWatchpoints(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) {
+        bool write = false;
+        uint16_t address = 0;
+        if (FindWatch(vm, pc, inst, write, address)) {
+            Prompt(vm, pc, inst, std::string(write ? "write of " : "read of ") + Hex(address));
+        }
+    }
+
+    bool debug_observer_tp::WouldStop(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) const {
+        bool write = false;
+        uint16_t address = 0;
+        return (!breakpoints.Empty() && breakpoints.Test(pc)) ||
+               ((!read_watches.Empty() || !write_watches.Empty()) && FindWatch(vm, pc, inst, write, address));
+    }
+
+    void debug_observer_tp::Announce(uint16_t pc, const instruction_tp &inst, const std::string &reason) const {
+        const char *name = kOpcodeName[inst.opcode] != nullptr ? kOpcodeName[inst.opcode] : "???";
+        output << reason << " at " << Hex(pc) << ": " << Hex(inst.inst) << ' ' << name << std::endl;
+    }
+
+    void debug_observer_tp::PrintHelp() const {
+        output << "s, step [n]       run n instructions (1)\n"
+                  "c, continue       run to the next breakpoint or watchpoint\n"
+                  "r, regs           show the registers\n"
+                  "x <addr> [n]      show n words of memory (8)\n"
+                  "b, break <addr>   stop before the instruction at addr\n"
+                  "w, watch <addr>   stop before a write to addr\n"
+                  "rw, rwatch <addr> stop before a read of addr\n"
+                  "d, delete <addr>  remove the breakpoint and watchpoints at addr\n"
+                  "i, info           list breakpoints and watchpoints\n"
+                  "rs, reverse-step [n]  go back n instructions (1)\n"
+                  "rc, reverse-continue  go back to the last breakpoint or watchpoint\n"
+                  "g, goto <cycle>   go to the given cycle, back or forward\n"
+                  "q, quit           stop the program\n"
+                  "an empty line repeats the last command" << std::endl;
+    }
+
+    void debug_observer_tp::Prompt(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst,
+                                   const std::string &reason) {
+        // Program output first, so the two do not interleave
+        vm.console.Flush();
+        Announce(pc, inst, reason);
+        // Once the machine has moved, NextStep has to fetch again from pc
+        bool moved = false;
+        auto resume = [&]() {
+            if (moved) {
+                vm.restart_step = true;
+                skip_next_stop = true;
+            }
+        };
+        while (true) {
+            output << "(lc3) " << std::flush;
+            std::string line;
+            if (!std::getline(input, line)) {
+                // No more commands: run to the end without stopping
+                output << std::endl;
+                steps_left = 0;
+                breakpoints = address_bitmap_tp();
+                read_watches = address_bitmap_tp();
+                write_watches = address_bitmap_tp();
+                resume();
+                return;
+            }
+            if (line.empty()) {
+                line = last_command;
+            } else {
+                last_command = line;
+            }
+            std::istringstream fields(line);
+            std::string command, argument;
+            fields >> command >> argument;
+            uint16_t address = 0;
+            bool has_address = ParseAddress(argument, address);
+
+            if (command == "s" || command == "step") {
+                uint64_t count = 1;
+                if (!argument.empty()) {
+                    count = std::max<uint64_t>(1, strtoull(argument.c_str(), nullptr, 10));
+                }
+                steps_left = count;
+                resume();
+                return;
+            } else if (command == "c" || command == "continue") {
+                steps_left = 0;
+                resume();
+                return;
+            } else if (command == "rs" || command == "reverse-step" || command == "rc" ||
+                       command == "reverse-continue" || command == "g" || command == "goto") {
+                if (history == nullptr) {
+                    output << "no history, reverse execution needs --history-interval > 0" << std::endl;
+                    continue;
+                }
+                if ((command == "g" || command == "goto") && argument.empty()) {
+                    output << "goto needs a cycle" << std::endl;
+                    continue;
+                }
+                // The machine stands before the instruction at pc
+                vm.reg[R_PC] = pc;
+                moved = true;
+                std::string where;
+                if (command == "rs" || command == "reverse-step") {
+                    uint64_t count = 1;
+                    if (!argument.empty()) {
+                        count = std::max<uint64_t>(1, strtoull(argument.c_str(), nullptr, 10));
+                    }
+                    uint64_t available = vm.cycle - history->Begin();
+                    history->Goto(vm, vm.cycle - std::min(count, available));
+                    where = count <= available ? "reverse step" : "start of history";
+                } else if (command == "rc" || command == "reverse-continue") {
+                    stop_predicate_tp stops = [this](virtual_machine_tp &machine, uint16_t at,
+                                                     const instruction_tp &fetched) {
+                        return WouldStop(machine, at, fetched);
+                    };
+                    where = history->ReverseFind(vm, stops) ? "reverse continue" : "start of history";
+                } else {
+                    uint64_t target = strtoull(argument.c_str(), nullptr, 10);
+                    where = history->Goto(vm, target) ? "cycle " + std::to_string(target) : "start of history";
+                }
+                if (vm.halted) {
+                    // Ran into the end: let NextStep finish the program
+                    output << "halted at cycle " << std::dec << vm.cycle << std::endl;
+                    resume();
+                    return;
+                }
+                pc = vm.reg[R_PC];
+                Announce(pc, vm.FetchDecoded(pc), where);
+            } else if (command == "r" || command == "regs") {
+                // The PC is already past the instruction we stopped before
+                register_tp shown = vm.reg;
+                shown[R_PC] = pc;
+                output << shown << "PSR = " << Hex(vm.ProcessorStatus()) << ", cycle = " << std::dec << vm.cycle
+                       << std::endl;
+            } else if (command == "x") {
+                if (!has_address) {
+                    output << "x needs an address" << std::endl;
+                    continue;
+                }
+                std::string count_text;
+                fields >> count_text;
+                int count = count_text.empty() ? 8 : std::max(1, atoi(count_text.c_str()));
+                for (int index = 0; index < count; ++index) {
+                    uint16_t current = address + index;
+                    if (index % 8 == 0) {
+                        output << (index == 0 ? "" : "\n") << Hex(current) << ':';
+                    }
+                    output << ' ' << Hex(vm.mem.GetContent(current));
+                }
+                output << std::endl;
+            } else if (command == "b" || command == "break" || command == "w" || command == "watch" ||
+                       command == "rw" || command == "rwatch" || command == "d" || command == "delete") {
+                if (!has_address) {
+                    output << command << " needs an address" << std::endl;
+                    continue;
+                }
+                if (command == "b" || command == "break") {
+                    breakpoints.Set(address);
+                } else if (command == "w" || command == "watch") {
+                    write_watches.Set(address);
+                } else if (command == "rw" || command == "rwatch") {
+                    read_watches.Set(address);
+                } else {
+                    breakpoints.Clear(address);
+                    read_watches.Clear(address);
+                    write_watches.Clear(address);
+                }
+            } else if (command == "i" || command == "info") {
+                const std::pair<const char *, const address_bitmap_tp *> kinds[] = {
+                    {"breakpoint", &breakpoints}, {"read watchpoint", &read_watches}, {"write watchpoint", &write_watches}};
+                for (const auto &kind : kinds) {
+                    for (uint16_t target : kind.second->Addresses()) {
+                        output << kind.first << ' ' << Hex(target) << std::endl;
+                    }
+                }
+            } else if (command == "q" || command == "quit") {
+                // Stop before the instruction, the run then ends as usual
+                vm.reg[R_PC] = pc;
+                vm.halted = true;
+                vm.restart_step = true;
+                vm.next_event_cycle = 0;
+                quit = true;
+                return;
+            } else if (command == "h" || command == "help") {
+                PrintHelp();
+            } else {
+                output << "unknown command " << command << ", try help" << std::endl;
+            }
+        }
+    }
+}; // virtual machine namespace
@@ -0,0 +1,792 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-27 15:20:44
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-27 15:20:44
+ * @Description  : GDB remote serial protocol stub
+ */
+#include "gdb_stub.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace virtual_machine_nsp {
+    static const char kHexDigits[] = "0123456789abcdef";
+    static const char kTargetDescription[] =
+        "<?xml version=\"1.0\"?>\n"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+        "<target version=\"1.0\">\n"
+        "  <feature name=\"org.lc3.core\">\n"
+        "    <reg name=\"r0\" bitsize=\"16\" type=\"int\" regnum=\"0\"/>\n"
+        "    <reg name=\"r1\" bitsize=\"16\" type=\"int\"/>\n"
+        "    <reg name=\"r2\" bitsize=\"16\" type=\"int\"/>\n"
+        "    <reg name=\"r3\" bitsize=\"16\" type=\"int\"/>\n"
+        "    <reg name=\"r4\" bitsize=\"16\" type=\"int\"/>\n"
+        "    <reg name=\"r5\" bitsize=\"16\" type=\"int\"/>\n"
+        "    <reg name=\"r6\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+        "    <reg name=\"r7\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+        "    <reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+        "    <reg name=\"cond\" bitsize=\"16\" type=\"int\"/>\n"
+        "  </feature>\n"
+        "</target>\n";
+    // Bound on executed bytecodes, a looping condition counts as true
+    const int kAgentStepLimit = 10000;
+    const int kAgentStackSize = 64;
+
+    // Agent expression bytecodes, see "Bytecode Descriptions" in the GDB manual
+    enum kAgentOpcodeList {
+        AX_FLOAT = 0x01, AX_ADD, AX_SUB, AX_MUL, AX_DIV_SIGNED, AX_DIV_UNSIGNED, AX_REM_SIGNED,
+        AX_REM_UNSIGNED, AX_LSH, AX_RSH_SIGNED, AX_RSH_UNSIGNED, AX_TRACE, AX_TRACE_QUICK, AX_LOG_NOT,
+        AX_BIT_AND, AX_BIT_OR, AX_BIT_XOR, AX_BIT_NOT, AX_EQUAL, AX_LESS_SIGNED, AX_LESS_UNSIGNED, AX_EXT,
+        AX_REF8, AX_REF16, AX_REF32, AX_REF64,
+        AX_IF_GOTO = 0x20, AX_GOTO, AX_CONST8, AX_CONST16, AX_CONST32, AX_CONST64, AX_REG, AX_END, AX_DUP,
+        AX_POP, AX_ZERO_EXT, AX_SWAP,
+        AX_TRACEV = 0x2e, AX_TRACENZ, AX_TRACE16,
+        AX_PICK = 0x32, AX_ROT
+    };
+
+    static int HexValue(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    static bool DecodeHex(const std::string &hex, std::string &bytes) {
+        if (hex.size() % 2 != 0) {
+            return false;
+        }
+        bytes.clear();
+        for (size_t index = 0; index < hex.size(); index += 2) {
+            int high = HexValue(hex[index]);
+            int low = HexValue(hex[index + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            bytes += char(high << 4 | low);
+        }
+        return true;
+    }
+
+    static void AppendByte(std::string &out, uint8_t value) {
+        out += kHexDigits[value >> 4];
+        out += kHexDigits[value & 15];
+    }
+
+    // Registers and words travel low byte first
+    static void AppendWord(std::string &out, uint16_t value) {
+        AppendByte(out, value & 0xFF);
+        AppendByte(out, value >> 8);
+    }
+
+    static bool ParseWord(const std::string &hex, uint16_t &value) {
+        std::string bytes;
+        if (hex.size() != 4 || !DecodeHex(hex, bytes)) {
+            return false;
+        }
+        value = uint8_t(bytes[0]) | uint8_t(bytes[1]) << 8;
+        return true;
+    }
+
+    static bool ParseNumber(const std::string &text, uint64_t &value) {
+        if (text.empty()) {
+            return false;
+        }
+        char *end = nullptr;
+        value = strtoull(text.c_str(), &end, 16);
+        return *end == '\0';
+    }
+
+    // "addr,length", both hex
+    static bool ParseRange(const std::string &text, uint16_t &address, uint64_t &length) {
+        size_t comma = text.find(',');
+        uint64_t start = 0;
+        if (comma == std::string::npos || !ParseNumber(text.substr(0, comma), start) || start > 0xFFFF ||
+            !ParseNumber(text.substr(comma + 1), length)) {
+            return false;
+        }
+        address = start;
+        return true;
+    }
+
+    static uint64_t ReadWords(const virtual_machine_tp &vm, uint16_t address, int count) {
+        uint64_t value = 0;
+        for (int index = count - 1; index >= 0; --index) {
+            value = value << 16 | uint16_t(vm.mem.GetContent(uint16_t(address + index)));
+        }
+        return value;
+    }
+
+    bool EvaluateAgentExpression(const std::string &bytecode, const virtual_machine_tp &vm, int64_t &result) {
+        int64_t stack[kAgentStackSize];
+        int depth = 0;
+        size_t pc = 0;
+        const uint8_t *code = reinterpret_cast<const uint8_t *>(bytecode.data());
+        size_t size = bytecode.size();
+        // Big-endian operand of n bytes after the opcode
+        auto operand = [&](size_t bytes, uint64_t &value) {
+            if (pc + bytes > size) {
+                return false;
+            }
+            value = 0;
+            for (size_t index = 0; index < bytes; ++index) {
+                value = value << 8 | code[pc++];
+            }
+            return true;
+        };
+        for (int executed = 0; executed < kAgentStepLimit && pc < size; ++executed) {
+            int opcode = code[pc++];
+            uint64_t argument = 0;
+            // Stack items the bytecode pops
+            int needed = 0;
+            switch (opcode) {
+                case AX_ADD: case AX_SUB: case AX_MUL: case AX_DIV_SIGNED: case AX_DIV_UNSIGNED:
+                case AX_REM_SIGNED: case AX_REM_UNSIGNED: case AX_LSH: case AX_RSH_SIGNED: case AX_RSH_UNSIGNED:
+                case AX_BIT_AND: case AX_BIT_OR: case AX_BIT_XOR: case AX_EQUAL: case AX_LESS_SIGNED:
+                case AX_LESS_UNSIGNED: case AX_SWAP: case AX_TRACE: case AX_TRACENZ:
+                    needed = 2;
+                    break;
+                case AX_ROT:
+                    needed = 3;
+                    break;
+                case AX_LOG_NOT: case AX_BIT_NOT: case AX_EXT: case AX_ZERO_EXT: case AX_REF8: case AX_REF16:
+                case AX_REF32: case AX_REF64: case AX_IF_GOTO: case AX_END: case AX_DUP: case AX_POP:
+                case AX_TRACE_QUICK: case AX_TRACE16:
+                    needed = 1;
+                    break;
+                default:
+                    break;
+            }
+            if (depth < needed || depth + 1 > kAgentStackSize) {
+                return false;
+            }
+            int64_t &top = stack[depth - 1 >= 0 ? depth - 1 : 0];
+            int64_t below = depth >= 2 ? stack[depth - 2] : 0;
+            switch (opcode) {
+                case AX_FLOAT:
+                    break;
+                case AX_ADD: stack[depth - 2] = below + top; --depth; break;
+                case AX_SUB: stack[depth - 2] = below - top; --depth; break;
+                case AX_MUL: stack[depth - 2] = below * top; --depth; break;
+                case AX_DIV_SIGNED: case AX_DIV_UNSIGNED: case AX_REM_SIGNED: case AX_REM_UNSIGNED:
+                    if (top == 0) {
+                        return false;
+                    }
+                    if (opcode == AX_DIV_SIGNED) {
+                        stack[depth - 2] = below / top;
+                    } else if (opcode == AX_DIV_UNSIGNED) {
+                        stack[depth - 2] = uint64_t(below) / uint64_t(top);
+                    } else if (opcode == AX_REM_SIGNED) {
+                        stack[depth - 2] = below % top;
+                    } else {
+                        stack[depth - 2] = uint64_t(below) % uint64_t(top);
+                    }
+                    --depth;
+                    break;
+                case AX_LSH: stack[depth - 2] = top >= 64 ? 0 : uint64_t(below) << top; --depth; break;
+                case AX_RSH_SIGNED: stack[depth - 2] = below >> std::min<int64_t>(top, 63); --depth; break;
+                case AX_RSH_UNSIGNED: stack[depth - 2] = top >= 64 ? 0 : uint64_t(below) >> top; --depth; break;
+                case AX_LOG_NOT: top = !top; break;
+                case AX_BIT_AND: stack[depth - 2] = below & top; --depth; break;
+                case AX_BIT_OR: stack[depth - 2] = below | top; --depth; break;
+                case AX_BIT_XOR: stack[depth - 2] = below ^ top; --depth; break;
+                case AX_BIT_NOT: top = ~top; break;
+                case AX_EQUAL: stack[depth - 2] = below == top; --depth; break;
+                case AX_LESS_SIGNED: stack[depth - 2] = below < top; --depth; break;
+                case AX_LESS_UNSIGNED: stack[depth - 2] = uint64_t(below) < uint64_t(top); --depth; break;
+                case AX_EXT: case AX_ZERO_EXT:
+                    if (!operand(1, argument) || argument == 0) {
+                        return false;
+                    }
+                    if (argument < 64) {
+                        uint64_t mask = (uint64_t(1) << argument) - 1;
+                        uint64_t sign = uint64_t(1) << (argument - 1);
+                        uint64_t value = uint64_t(top) & mask;
+                        top = opcode == AX_EXT ? int64_t((value ^ sign) - sign) : int64_t(value);
+                    }
+                    break;
+                case AX_REF8: top = uint16_t(vm.mem.GetContent(uint16_t(top))) & 0xFF; break;
+                case AX_REF16: top = ReadWords(vm, uint16_t(top), 1); break;
+                case AX_REF32: top = ReadWords(vm, uint16_t(top), 2); break;
+                case AX_REF64: top = ReadWords(vm, uint16_t(top), 4); break;
+                case AX_IF_GOTO: case AX_GOTO:
+                    if (!operand(2, argument)) {
+                        return false;
+                    }
+                    if (opcode == AX_GOTO) {
+                        pc = argument;
+                    } else if (stack[--depth] != 0) {
+                        pc = argument;
+                    }
+                    break;
+                case AX_CONST8: case AX_CONST16: case AX_CONST32: case AX_CONST64:
+                    if (!operand(size_t(1) << (opcode - AX_CONST8), argument)) {
+                        return false;
+                    }
+                    stack[depth++] = argument;
+                    break;
+                case AX_REG:
+                    if (!operand(2, argument) || argument >= kGdbRegisterCount) {
+                        return false;
+                    }
+                    stack[depth++] = uint16_t(vm.reg[argument]);
+                    break;
+                case AX_END:
+                    result = top;
+                    return true;
+                case AX_DUP: stack[depth] = top; ++depth; break;
+                case AX_POP: --depth; break;
+                case AX_SWAP: std::swap(stack[depth - 1], stack[depth - 2]); break;
+                case AX_PICK:
+                    if (!operand(1, argument) || argument >= uint64_t(depth)) {
+                        return false;
+                    }
+                    stack[depth] = stack[depth - 1 - argument];
+                    ++depth;
+                    break;
+                case AX_ROT:
+                    // a b c => c a b
+                    std::rotate(stack + depth - 3, stack + depth - 1, stack + depth);
+                    break;
+                // Tracing only matters to tracepoints: keep the stack effect
+                case AX_TRACE: case AX_TRACENZ: depth -= 2; break;
+                case AX_TRACE_QUICK:
+                    if (!operand(1, argument)) {
+                        return false;
+                    }
+                    break;
+                case AX_TRACE16: case AX_TRACEV:
+                    if (!operand(2, argument)) {
+                        return false;
+                    }
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    gdb_stub_tp::~gdb_stub_tp() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        if (!socket_path.empty()) {
+            unlink(socket_path.c_str());
+        }
+    }
+
+    bool gdb_stub_tp::Listen(const std::string &where, std::string &error) {
+        std::string port = where[0] == ':' ? where.substr(1) : where;
+        bool is_port = !port.empty() && port.find_first_not_of("0123456789") == std::string::npos;
+        if (is_port) {
+            listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            int enable = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(atoi(port.c_str()));
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+                error = "cannot listen on port " + port + ": " + strerror(errno);
+                return false;
+            }
+        } else {
+            listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (where.size() >= sizeof(address.sun_path)) {
+                error = "socket path too long: " + where;
+                return false;
+            }
+            strcpy(address.sun_path, where.c_str());
+            // A socket left behind by an earlier run
+            unlink(where.c_str());
+            socket_path = where;
+            if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+                error = "cannot listen on " + where + ": " + strerror(errno);
+                return false;
+            }
+        }
+        if (listen(listen_fd, 1) != 0) {
+            error = std::string("cannot listen: ") + strerror(errno);
+            return false;
+        }
+        std::cerr << "waiting for gdb on " << (is_port ? "127.0.0.1:" + port : where) << std::endl;
+        return true;
+    }
+
+    bool gdb_stub_tp::Start(virtual_machine_tp &vm) {
+        fd = accept(listen_fd, nullptr, nullptr);
+        close(listen_fd);
+        listen_fd = -1;
+        if (fd < 0) {
+            return false;
+        }
+        // Packets are small and answered one at a time
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        if (!Serve(vm, "")) {
+            detached = true;
+        }
+        return true;
+    }
+
+    void gdb_stub_tp::Exited(virtual_machine_tp &vm) {
+        if (fd < 0 || detached) {
+            return;
+        }
+        vm.console.Flush();
+        SendPacket("W00");
+        close(fd);
+        fd = -1;
+    }
+
+    bool gdb_stub_tp::ReadPacket(std::string &packet) {
+        while (true) {
+            size_t start = incoming.find('$');
+            size_t end = start == std::string::npos ? std::string::npos : incoming.find('#', start);
+            if (end != std::string::npos && end + 2 < incoming.size()) {
+                std::string body = incoming.substr(start + 1, end - start - 1);
+                int high = HexValue(incoming[end + 1]);
+                int low = HexValue(incoming[end + 2]);
+                incoming.erase(0, end + 3);
+                uint8_t sum = 0;
+                for (char c : body) {
+                    sum += uint8_t(c);
+                }
+                if (high < 0 || low < 0 || sum != (high << 4 | low)) {
+                    if (!no_ack) {
+                        write(fd, "-", 1);
+                    }
+                    continue;
+                }
+                if (!no_ack) {
+                    write(fd, "+", 1);
+                }
+                // Undo the escapes of binary data
+                packet.clear();
+                for (size_t index = 0; index < body.size(); ++index) {
+                    if (body[index] == '}' && index + 1 < body.size()) {
+                        packet += char(body[++index] ^ 0x20);
+                    } else {
+                        packet += body[index];
+                    }
+                }
+                return true;
+            }
+            if (start == std::string::npos) {
+                // Acks and ^C while stopped mean nothing
+                incoming.clear();
+            }
+            char buffer[4096];
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                return false;
+            }
+            incoming.append(buffer, length);
+        }
+    }
+
+    void gdb_stub_tp::SendPacket(const std::string &data) {
+        uint8_t sum = 0;
+        for (char c : data) {
+            sum += uint8_t(c);
+        }
+        std::string packet = "$" + data + "#"; 
+        AppendByte(packet, sum);
+        while (true) {
+            for (size_t sent = 0; sent < packet.size();) {
+                ssize_t length = write(fd, packet.data() + sent, packet.size() - sent);
+                if (length <= 0) {
+                    return;
+                }
+                sent += length;
+            }
+            if (no_ack) {
+                return;
+            }
+            // Resend on '-', give up if the debugger is gone
+            char reply = 0;
+            while (incoming.empty()) {
+                char buffer[256];
+                ssize_t length = read(fd, buffer, sizeof(buffer));
+                if (length <= 0) {
+                    return;
+                }
+                incoming.append(buffer, length);
+            }
+            reply = incoming[0];
+            if (reply == '+' || reply == '-') {
+                incoming.erase(0, 1);
+            }
+            if (reply != '-') {
+                return;
+            }
+        }
+    }
+
+    bool gdb_stub_tp::InterruptRequested() {
+        char c;
+        while (recv(fd, &c, 1, MSG_DONTWAIT) == 1) {
+            if (c == '\x03') {
+                return true;
+            }
+            // Anything else arriving while running starts a packet
+            incoming += c;
+        }
+        return false;
+    }
+
+    void gdb_stub_tp::Stop(virtual_machine_tp &vm, std::string stop_reply) {
+        steps_left = 0;
+        watch_hit.clear();
+        // Program output first, so it is not reordered behind the stop
+        vm.console.Flush();
+        if (!Serve(vm, stop_reply)) {
+            // The debugger went away: run to the end without stopping
+            detached = true;
+            breakpoints = address_bitmap_tp();
+            read_watches = address_bitmap_tp();
+            write_watches = address_bitmap_tp();
+        }
+        resume_pc = uint16_t(vm.reg[R_PC]);
+    }
+
+    bool gdb_stub_tp::Serve(virtual_machine_tp &vm, const std::string &stop_reply) {
+        if (!stop_reply.empty()) {
+            last_stop = stop_reply;
+            SendPacket(stop_reply);
+        }
+        std::string packet;
+        while (ReadPacket(packet)) {
+            bool resume = false;
+            std::string reply = HandlePacket(vm, packet, resume);
+            if (resume) {
+                return !detached;
+            }
+            SendPacket(reply);
+            if (packet == "QStartNoAckMode") {
+                no_ack = true;
+            }
+        }
+        return false;
+    }
+
+    std::string gdb_stub_tp::Resume(virtual_machine_tp &vm, char action, const std::string &address, bool &resume) {
+        if (!address.empty()) {
+            uint64_t target = 0;
+            if (!ParseNumber(address, target) || target > 0xFFFF) {
+                return "E01";
+            }
+            vm.reg[R_PC] = target;
+        }
+        steps_left = action == 's' || action == 'S' ? 1 : 0;
+        poll_countdown = kGdbPollInterval;
+        resume = true;
+        return "";
+    }
+
+    std::string gdb_stub_tp::SetPoint(const std::string &packet, bool insert) {
+        // Z<type>,<addr>,<kind>[;X<len>,<bytecode>...]
+        size_t semicolon = packet.find(';');
+        std::string head = packet.substr(0, semicolon);
+        if (head.size() < 3 || head[2] != ',') {
+            return "E01";
+        }
+        int type = head[1] - '0';
+        uint16_t address = 0;
+        uint64_t kind = 0;
+        if (type < 0 || type > 4 || !ParseRange(head.substr(3), address, kind)) {
+            return "E01";
+        }
+        if (type <= 1) {
+            std::vector<std::string> list;
+            while (semicolon != std::string::npos) {
+                size_t next = packet.find(';', semicolon + 1);
+                std::string item = packet.substr(semicolon + 1, next == std::string::npos ? next : next - semicolon - 1);
+                semicolon = next;
+                if (item.compare(0, 5, "cmds:") == 0) {
+                    break;
+                }
+                size_t comma = item.find(',');
+                std::string bytecode;
+                if (item.empty() || item[0] != 'X' || comma == std::string::npos ||
+                    !DecodeHex(item.substr(comma + 1), bytecode)) {
+                    return "E02";
+                }
+                list.push_back(bytecode);
+            }
+            if (insert) {
+                breakpoints.Set(address);
+                if (list.empty()) {
+                    conditions.erase(address);
+                } else {
+                    conditions[address] = list;
+                }
+            } else {
+                breakpoints.Clear(address);
+                conditions.erase(address);
+            }
+            return "OK";
+        }
+        // Watch lengths are in bytes, two per word
+        uint64_t words = std::max<uint64_t>(1, (kind + 1) / 2);
+        for (uint64_t index = 0; index < words && index < kVirtualMachineMemorySize; ++index) {
+            uint16_t target = address + index;
+            if (type == 2 || type == 4) {
+                insert ? write_watches.Set(target) : write_watches.Clear(target);
+            }
+            if (type == 3 || type == 4) {
+                insert ? read_watches.Set(target) : read_watches.Clear(target);
+            }
+        }
+        return "OK";
+    }
+
+    bool gdb_stub_tp::BreakpointHolds(const virtual_machine_tp &vm, uint16_t address) {
+        auto found = conditions.find(address);
+        if (found == conditions.end()) {
+            return true;
+        }
+        for (const std::string &bytecode : found->second) {
+            int64_t value = 0;
+            // A condition we cannot evaluate stops, like gdb would
+            if (!EvaluateAgentExpression(bytecode, vm, value) || value != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Finds the first watched word among the accesses of one instruction
+    struct gdb_watch_visitor_tp {
+        const gdb_stub_tp &stub;
+        bool hit = false;
+        bool read = false;
+        bool write = false;
+        uint16_t address = 0;
+
+        explicit gdb_watch_visitor_tp(const gdb_stub_tp &stub) : stub(stub) {}
+        void Fetch(uint16_t) {}
+        void Read(uint16_t target) {
+            if (!hit && stub.read_watches.Test(target)) {
+                hit = read = true;
+                address = target;
+            }
+        }
+        void Write(uint16_t target) {
+            if (!hit && stub.write_watches.Test(target)) {
+                hit = write = true;
+                address = target;
+            }
+        }
+    };
+
+    void gdb_stub_tp::CheckWatchpoints(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) {
+        gdb_watch_visitor_tp visitor(*this);
+        VisitAccesses(vm, pc, inst, visitor);
+        if (!visitor.hit) {
+            return;
+        }
+        // Both bitmaps set means an access watchpoint
+        bool access = read_watches.Test(visitor.address) && write_watches.Test(visitor.address);
+        std::string reply = access ? "T05awatch:" : visitor.write ? "T05watch:" : "T05rwatch:";
+        std::ostringstream os;
+        os << std::hex << visitor.address;
+        watch_hit = reply + os.str() + ";thread:1;";
+    }
+
+    std::string gdb_stub_tp::HandlePacket(virtual_machine_tp &vm, const std::string &packet, bool &resume) {
+        if (packet.empty()) {
+            return "";
+        }
+        std::string argument = packet.substr(1);
+        switch (packet[0]) {
+            case '?':
+                return last_stop;
+            case 'g': {
+                std::string reply;
+                for (int index = 0; index < kGdbRegisterCount; ++index) {
+                    AppendWord(reply, vm.reg[index]);
+                }
+                return reply;
+            }
+            case 'G': {
+                if (argument.size() != kGdbRegisterCount * 4) {
+                    return "E01";
+                }
+                register_tp values = vm.reg;
+                for (int index = 0; index < kGdbRegisterCount; ++index) {
+                    uint16_t value = 0;
+                    if (!ParseWord(argument.substr(index * 4, 4), value)) {
+                        return "E01";
+                    }
+                    values[index] = value;
+                }
+                vm.reg = values;
+                return "OK";
+            }
+            case 'p': {
+                uint64_t index = 0;
+                if (!ParseNumber(argument, index) || index >= kGdbRegisterCount) {
+                    return "E01";
+                }
+                std::string reply;
+                AppendWord(reply, vm.reg[index]);
+                return reply;
+            }
+            case 'P': {
+                size_t equal = argument.find('=');
+                uint64_t index = 0;
+                uint16_t value = 0;
+                if (equal == std::string::npos || !ParseNumber(argument.substr(0, equal), index) ||
+                    index >= kGdbRegisterCount || !ParseWord(argument.substr(equal + 1), value)) {
+                    return "E01";
+                }
+                vm.reg[index] = value;
+                return "OK";
+            }
+            case 'm': {
+                uint16_t address = 0;
+                uint64_t length = 0;
+                if (!ParseRange(argument, address, length) || length > 2 * kVirtualMachineMemorySize) {
+                    return "E01";
+                }
+                // Plain reads, KBDR and friends are not consumed
+                std::string reply;
+                for (uint64_t index = 0; index < length; ++index) {
+                    uint16_t word = vm.mem.GetContent(uint16_t(address + index / 2));
+                    AppendByte(reply, index % 2 == 0 ? word & 0xFF : word >> 8);
+                }
+                return reply;
+            }
+            case 'M': {
+                size_t colon = argument.find(':');
+                uint16_t address = 0;
+                uint64_t length = 0;
+                std::string bytes;
+                if (colon == std::string::npos || !ParseRange(argument.substr(0, colon), address, length) ||
+                    !DecodeHex(argument.substr(colon + 1), bytes) || bytes.size() != length) {
+                    return "E01";
+                }
+                // An odd length keeps the other half of the last word. Plain
+                // writes like the reads: no output, halt or timer change.
+                for (uint64_t index = 0; index < length; index += 2) {
+                    uint16_t target = address + index / 2;
+                    uint16_t word = vm.mem.GetContent(target);
+                    word = (word & 0xFF00) | uint8_t(bytes[index]);
+                    if (index + 1 < length) {
+                        word = (word & 0x00FF) | uint8_t(bytes[index + 1]) << 8;
+                    }
+                    vm.mem[target] = word;
+                    vm.InvalidateDecoded(target);
+                }
+                return "OK";
+            }
+            case 'c': case 's':
+                return Resume(vm, packet[0], argument, resume);
+            case 'C': case 'S': {
+                // The signal is dropped, the LC-3 has none
+                size_t semicolon = argument.find(';');
+                return Resume(vm, packet[0], semicolon == std::string::npos ? "" : argument.substr(semicolon + 1),
+                              resume);
+            }
+            case 'v':
+                if (packet == "vCont?") {
+                    return "vCont;c;C;s;S";
+                }
+                if (packet.compare(0, 6, "vCont;") == 0) {
+                    // One thread: the first action for it or for all threads wins
+                    size_t position = 5;
+                    while (position != std::string::npos) {
+                        size_t next = packet.find(';', position + 1);
+                        std::string action = packet.substr(position + 1, next == std::string::npos ? next : next - position - 1);
+                        position = next;
+                        size_t colon = action.find(':');
+                        std::string thread = colon == std::string::npos ? "" : action.substr(colon + 1);
+                        if (!action.empty() && (thread.empty() || thread == "1" || thread == "-1" || thread == "p1.1" ||
+                                                thread == "p1.-1")) {
+                            return Resume(vm, action[0], "", resume);
+                        }
+                    }
+                    return "E01";
+                }
+                return "";
+            case 'Z': case 'z':
+                return SetPoint(packet, packet[0] == 'Z');
+            case 'H': case 'T':
+                return "OK";
+            case 'k':
+                vm.console.Flush();
+                std::exit(0);
+            case 'D':
+                SendPacket("OK");
+                detached = true;
+                breakpoints = address_bitmap_tp();
+                read_watches = address_bitmap_tp();
+                write_watches = address_bitmap_tp();
+                close(fd);
+                fd = -1;
+                resume = true;
+                return "";
+            case 'q':
+                if (packet.compare(0, 10, "qSupported") == 0) {
+                    return "PacketSize=4000;QStartNoAckMode+;qXfer:features:read+;ConditionalBreakpoints+;swbreak+;"
+                           "vContSupported+";
+                }
+                if (packet == "qAttached") {
+                    return "1";
+                }
+                if (packet == "qC") {
+                    return "QC1";
+                }
+                if (packet == "qfThreadInfo") {
+                    return "m1";
+                }
+                if (packet == "qsThreadInfo") {
+                    return "l";
+                }
+                if (packet == "qOffsets") {
+                    return "Text=0;Data=0;Bss=0";
+                }
+                if (packet.compare(0, 8, "qSymbol:") == 0) {
+                    return "OK";
+                }
+                if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0) {
+                    uint16_t offset = 0;
+                    uint64_t length = 0;
+                    if (!ParseRange(packet.substr(31), offset, length)) {
+                        return "E01";
+                    }
+                    std::string description = kTargetDescription;
+                    if (offset >= description.size()) {
+                        return "l";
+                    }
+                    std::string chunk = description.substr(offset, length);
+                    return (offset + chunk.size() >= description.size() ? "l" : "m") + chunk;
+                }
+                return "";
+            case 'Q':
+                return packet == "QStartNoAckMode" ? "OK" : "";
+            default:
+                return "";
+        }
+    }
+}; // virtual machine namespace
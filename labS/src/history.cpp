@@ -0,0 +1,196 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-29 10:12:36
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-29 10:12:36
+ * @Description  : execution history for reverse debugging
+ */
+#include "history.h"
+#include "observer.h"
+
+namespace virtual_machine_nsp {
+    // Where an instruction writes, and whether it touches a device
+    struct undo_visitor_tp {
+        bool device = false;
+        bool wrote = false;
+        uint16_t address = 0;
+
+        void Fetch(uint16_t target) {
+            device = device || target >= kDeviceBase;
+        }
+        void Read(uint16_t target) {
+            device = device || target >= kDeviceBase;
+        }
+        void Write(uint16_t target) {
+            device = device || target >= kDeviceBase;
+            wrote = true;
+            address = target;
+        }
+    };
+
+    void history_tp::TakeSnapshot(virtual_machine_tp &vm, uint16_t pc) {
+        machine_state_tp state;
+        state.cycle = vm.cycle;
+        state.reg = vm.reg;
+        state.reg[R_PC] = pc;
+        state.memory.resize(kVirtualMachineMemorySize);
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            state.memory[address] = vm.mem.GetContent(address);
+        }
+        state.user_mode = vm.user_mode;
+        state.priority = vm.priority;
+        state.saved_ssp = vm.saved_ssp;
+        state.saved_usp = vm.saved_usp;
+        state.next_event_cycle = vm.next_event_cycle;
+        state.events = vm.events;
+        state.interrupts = vm.interrupts;
+        state.timer = vm.timer;
+        state.keyboard_interrupt_enable = vm.keyboard_interrupt_enable;
+        state.keyboard_polling = vm.keyboard_polling;
+        state.prompt_shown = vm.prompt_shown;
+        state.console = vm.console.SaveState();
+        snapshots.push_back(std::move(state));
+        if (snapshots.size() > kHistorySnapshots) {
+            // Keep every other one, the first included, and space them wider
+            size_t kept = 0;
+            for (size_t index = 0; index < snapshots.size(); index += 2) {
+                snapshots[kept++] = std::move(snapshots[index]);
+            }
+            snapshots.resize(kept);
+            interval *= 2;
+        }
+    }
+
+    void history_tp::Restore(virtual_machine_tp &vm, size_t index) {
+        snapshots.resize(index + 1);
+        const machine_state_tp &state = snapshots[index];
+        undo.clear();
+        undo_end = state.cycle;
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            if (vm.mem.GetContent(address) != state.memory[address]) {
+                vm.mem[address] = state.memory[address];
+                vm.InvalidateDecoded(address);
+            }
+        }
+        vm.reg = state.reg;
+        vm.cycle = state.cycle;
+        vm.halted = false;
+        vm.input_wait = false;
+        vm.user_mode = state.user_mode;
+        vm.priority = state.priority;
+        vm.saved_ssp = state.saved_ssp;
+        vm.saved_usp = state.saved_usp;
+        vm.next_event_cycle = state.next_event_cycle;
+        vm.events = state.events;
+        vm.interrupts = state.interrupts;
+        vm.timer = state.timer;
+        vm.keyboard_interrupt_enable = state.keyboard_interrupt_enable;
+        vm.keyboard_polling = state.keyboard_polling;
+        vm.prompt_shown = state.prompt_shown;
+        vm.console.RestoreState(state.console);
+        if (vm.replay != nullptr) {
+            vm.replay->Rewind(state.cycle);
+        }
+    }
+
+    void history_tp::RunTo(virtual_machine_tp &vm, uint64_t cycle, const stop_predicate_tp *predicate, bool &found,
+                           uint64_t &hit) {
+        history_observer_tp observer(*this, predicate);
+        vm.PrepareDecode();
+        while (!vm.halted && vm.cycle < cycle) {
+            vm.NextStep(observer);
+        }
+        found = observer.found;
+        hit = observer.hit;
+    }
+
+    void history_tp::Record(virtual_machine_tp &vm, uint16_t pc, const instruction_tp &inst) {
+        if (snapshots.empty() || vm.cycle >= snapshots.back().cycle + interval) {
+            TakeSnapshot(vm, pc);
+        }
+        if (vm.cycle != undo_end) {
+            undo.clear();
+        }
+        undo_end = vm.cycle + 1;
+        undo_visitor_tp visitor;
+        VisitAccesses(vm, pc, inst, visitor);
+        // Traps, RTI, devices and service points change more than a record holds
+        if (visitor.device || inst.opcode == O_TRAP || inst.opcode == O_RTI || vm.cycle + 1 >= vm.next_event_cycle) {
+            undo.clear();
+            return;
+        }
+        undo_record_tp record;
+        record.pc = pc;
+        record.cond = vm.reg[R_COND];
+        // JSR writes R7, the others at most their DR (BR and stores leave it alone)
+        record.reg_index = inst.opcode == O_JSR ? uint8_t(R_R7) : inst.dr;
+        record.reg_value = vm.reg[record.reg_index];
+        record.wrote = visitor.wrote;
+        record.address = visitor.address;
+        record.word = visitor.wrote ? vm.mem.GetContent(visitor.address) : 0;
+        undo.push_back(record);
+        if (undo.size() > 2 * interval) {
+            undo.pop_front();
+        }
+    }
+
+    bool history_tp::Goto(virtual_machine_tp &vm, uint64_t cycle) {
+        bool found = false;
+        uint64_t hit = 0;
+        if (cycle >= vm.cycle) {
+            RunTo(vm, cycle, nullptr, found, hit);
+            return vm.cycle == cycle;
+        }
+        if (vm.cycle == undo_end && vm.cycle - cycle <= undo.size()) {
+            for (; vm.cycle > cycle; --vm.cycle) {
+                const undo_record_tp &record = undo.back();
+                vm.reg[record.reg_index] = record.reg_value;
+                vm.reg[R_COND] = record.cond;
+                vm.reg[R_PC] = record.pc;
+                if (record.wrote) {
+                    vm.StoreMemory(record.address, record.word);
+                }
+                undo.pop_back();
+            }
+            undo_end = cycle;
+            while (!snapshots.empty() && snapshots.back().cycle > cycle) {
+                snapshots.pop_back();
+            }
+            return true;
+        }
+        if (snapshots.empty()) {
+            return false;
+        }
+        // The last snapshot at or before cycle
+        auto later = std::upper_bound(snapshots.begin(), snapshots.end(), cycle,
+                                      [](uint64_t value, const machine_state_tp &state) { return value < state.cycle; });
+        size_t index = later == snapshots.begin() ? 0 : later - snapshots.begin() - 1;
+        Restore(vm, index);
+        RunTo(vm, cycle, nullptr, found, hit);
+        return vm.cycle == cycle;
+    }
+
+    bool history_tp::ReverseFind(virtual_machine_tp &vm, const stop_predicate_tp &predicate) {
+        uint64_t end = vm.cycle;
+        while (true) {
+            // Run each interval again, latest first, until one has a hit
+            auto later = std::lower_bound(snapshots.begin(), snapshots.end(), end,
+                                          [](const machine_state_tp &state, uint64_t value) { return state.cycle < value; });
+            if (later == snapshots.begin()) {
+                break;
+            }
+            size_t index = later - snapshots.begin() - 1;
+            uint64_t start = snapshots[index].cycle;
+            bool found = false;
+            uint64_t hit = 0;
+            Restore(vm, index);
+            RunTo(vm, end, &predicate, found, hit);
+            if (found) {
+                return Goto(vm, hit);
+            }
+            end = start;
+        }
+        Goto(vm, Begin());
+        return false;
+    }
+}; // virtual machine namespace
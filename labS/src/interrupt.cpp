@@ -0,0 +1,33 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-18 16:02:40
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-18 16:02:40
+ * @Description  : device event scheduler and priority interrupt controller
+ */
+#include "interrupt.h"
+
+namespace virtual_machine_nsp {
+    // Events due at the same cycle run in kind order, so runs are repeatable
+    static bool LaterEvent(const event_tp &first, const event_tp &second) {
+        if (first.cycle != second.cycle) {
+            return first.cycle > second.cycle;
+        }
+        return first.kind > second.kind;
+    }
+
+    void event_scheduler_tp::Post(uint64_t cycle, int kind, uint32_t generation) {
+        heap.push_back(event_tp{cycle, kind, generation});
+        std::push_heap(heap.begin(), heap.end(), LaterEvent);
+    }
+
+    bool event_scheduler_tp::PopDue(uint64_t cycle, event_tp &event) {
+        if (heap.empty() || heap.front().cycle > cycle) {
+            return false;
+        }
+        std::pop_heap(heap.begin(), heap.end(), LaterEvent);
+        event = heap.back();
+        heap.pop_back();
+        return true;
+    }
+}; // virtual machine namespace
@@ -0,0 +1,286 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-11-28 16:02:51
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-11-28 16:02:51
+ * @Description  : lockstep execution of one program over many register sets
+ */
+#include "lockstep.h"
+
+#include <sstream>
+
+namespace virtual_machine_nsp {
+    const uint64_t kLockstepRunSlice = 1 << 20;
+
+    lockstep_machine_tp::lockstep_machine_tp(const memory_tp &image, uint16_t address,
+                                             const std::vector<register_tp> &lanes) : mem(image) {
+        memset(reg, 0, sizeof(reg));
+        memset(cond, 0, sizeof(cond));
+        active = 0;
+        for (size_t lane = 0; lane < lanes.size() && lane < kLockstepLanes; ++lane) {
+            for (int index = R_R0; index <= R_R7; ++index) {
+                reg[index][lane] = lanes[lane][index];
+            }
+            active |= 1u << lane;
+        }
+        pc = address;
+        decode_cache.resize(kDecodeCacheSize);
+    }
+
+    int16_t lockstep_machine_tp::FirstActive(const int16_t *values) const {
+        return values[__builtin_ctz(active)];
+    }
+
+    uint32_t lockstep_machine_tp::LanesEqual(const int16_t *values, int16_t value) const {
+        uint32_t mask = 0;
+        for (int lane = 0; lane < kLockstepLanes; ++lane) {
+            mask |= uint32_t(values[lane] == value) << lane;
+        }
+        return mask & active;
+    }
+
+    void lockstep_machine_tp::UpdateCond(int dr) {
+        for (int lane = 0; lane < kLockstepLanes; ++lane) {
+            int16_t value = reg[dr][lane];
+            cond[lane] = value == 0 ? 2 : (value < 0 ? 4 : 1);
+        }
+    }
+
+    void lockstep_machine_tp::Finish(uint32_t lanes, bool halted) {
+        for (int lane = 0; lane < kLockstepLanes; ++lane) {
+            if (lanes & (1u << lane)) {
+                for (int index = R_R0; index <= R_R7; ++index) {
+                    result[lane].reg[index] = reg[index][lane];
+                }
+                result[lane].reg[R_PC] = pc;
+                result[lane].reg[R_COND] = cond[lane];
+                result[lane].cycles = steps;
+                result[lane].halted = halted;
+            }
+        }
+        active &= ~lanes;
+    }
+
+    bool lockstep_machine_tp::TouchesDevice(const instruction_tp &inst, const int16_t *base) const {
+        uint16_t address = pc + 1 + inst.imm;
+        switch (inst.opcode) {
+            case O_LD:
+            case O_ST:
+            return address >= kDeviceBase;
+            case O_LDI:
+            case O_STI:
+            return address >= kDeviceBase || uint16_t(mem.GetContent(address)) >= kDeviceBase;
+            case O_LDR:
+            case O_STR:
+            for (int lane = 0; lane < kLockstepLanes; ++lane) {
+                if ((active & (1u << lane)) && uint16_t(base[lane] + inst.imm) >= kDeviceBase) {
+                    return true;
+                }
+            }
+            return false;
+            default:
+            return false;
+        }
+    }
+
+    // Continue the given lanes on their own from the current (not yet executed) instruction
+    void lockstep_machine_tp::Split(uint32_t lanes, uint64_t max_steps) {
+        for (int lane = 0; lane < kLockstepLanes; ++lane) {
+            if (!(lanes & (1u << lane))) {
+                continue;
+            }
+            std::unique_ptr<virtual_machine_tp> virtual_machine(new virtual_machine_tp());
+            virtual_machine->mem = mem;
+            for (int index = R_R0; index <= R_R7; ++index) {
+                virtual_machine->reg[index] = reg[index][lane];
+            }
+            virtual_machine->reg[R_PC] = pc;
+            virtual_machine->reg[R_COND] = cond[lane];
+            virtual_machine->cycle = steps;
+            // Like batch jobs, split lanes have no console
+            std::istringstream no_input;
+            std::ostringstream output;
+            virtual_machine->console.Attach(&no_input, &output);
+
+            uint64_t cycles = steps;
+            while (!virtual_machine->halted && cycles < max_steps) {
+                cycles += virtual_machine->Run(std::min(kLockstepRunSlice, max_steps - cycles));
+                virtual_machine->console.Flush();
+                output.str("");
+            }
+            result[lane].reg = virtual_machine->reg;
+            result[lane].cycles = cycles;
+            result[lane].halted = virtual_machine->halted;
+            ++split_lanes;
+        }
+        active &= ~lanes;
+    }
+
+    void lockstep_machine_tp::Run(uint64_t max_steps) {
+        while (active != 0 && steps < max_steps) {
+            instruction_tp &entry = decode_cache[pc];
+            if (entry.length == 0) {
+                entry = virtual_machine_tp::Decode(mem[pc]);
+            }
+            // A store may overwrite the entry, work on a copy
+            const instruction_tp inst = entry;
+            const uint16_t next_pc = pc + 1;
+            int16_t *dr = reg[inst.dr];
+            const int16_t *sr1 = reg[inst.sr1];
+            const int16_t *sr2 = reg[inst.sr2];
+            // Device registers are console I/O too
+            if (TouchesDevice(inst, sr1)) {
+                Split(active, max_steps);
+                return;
+            }
+
+            switch (inst.opcode) {
+                case O_ADD:
+                if (inst.flag) {
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = sr1[lane] + inst.imm;
+                } else {
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = sr1[lane] + sr2[lane];
+                }
+                UpdateCond(inst.dr);
+                break;
+                case O_AND:
+                if (inst.flag) {
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = sr1[lane] & inst.imm;
+                } else {
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = sr1[lane] & sr2[lane];
+                }
+                UpdateCond(inst.dr);
+                break;
+                case O_NOT:
+                for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = ~sr1[lane];
+                UpdateCond(inst.dr);
+                break;
+                case O_LEA:
+                for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = next_pc + inst.imm;
+                break;
+                case O_LD:
+                case O_LDI: {
+                    uint16_t address = next_pc + inst.imm;
+                    int16_t value = inst.opcode == O_LD ? mem[address] : mem[uint16_t(mem[address])];
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = value;
+                    UpdateCond(inst.dr);
+                    break;
+                }
+                case O_LDR:
+                // Memory is shared, so a gather is enough
+                for (int lane = 0; lane < kLockstepLanes; ++lane) dr[lane] = mem[uint16_t(sr1[lane] + inst.imm)];
+                UpdateCond(inst.dr);
+                break;
+                case O_ST:
+                case O_STI:
+                case O_STR: {
+                    // Lanes storing another value or to another address leave the group
+                    uint16_t address;
+                    uint32_t same = LanesEqual(dr, FirstActive(dr));
+                    if (inst.opcode == O_STR) {
+                        int16_t lane_address[kLockstepLanes];
+                        for (int lane = 0; lane < kLockstepLanes; ++lane) lane_address[lane] = sr1[lane] + inst.imm;
+                        address = FirstActive(lane_address);
+                        same &= LanesEqual(lane_address, address);
+                    } else {
+                        address = next_pc + inst.imm;
+                        if (inst.opcode == O_STI) {
+                            address = mem[address];
+                        }
+                    }
+                    if (same != active) {
+                        Split(active & ~same, max_steps);
+                    }
+                    mem[address] = FirstActive(dr);
+                    decode_cache[address].length = 0;
+                    break;
+                }
+                case O_BR: {
+                    if (inst.inst == 0) {
+                        ++steps;
+                        pc = next_pc;
+                        Finish(active, true);
+                        return;
+                    }
+                    uint32_t taken = 0;
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) {
+                        taken |= uint32_t((inst.dr & cond[lane]) != 0) << lane;
+                    }
+                    taken &= active;
+                    if (taken != 0 && taken != active) {
+                        // Keep the larger group together
+                        if (__builtin_popcount(taken) * 2 >= __builtin_popcount(active)) {
+                            Split(active & ~taken, max_steps);
+                        } else {
+                            Split(taken, max_steps);
+                        }
+                    }
+                    pc = (taken & active) ? uint16_t(next_pc + inst.imm) : next_pc;
+                    break;
+                }
+                case O_JMP:
+                case O_JSR: {
+                    uint16_t target = next_pc + inst.imm;
+                    if (inst.opcode == O_JMP || !inst.flag) {
+                        target = FirstActive(sr1);
+                        uint32_t same = LanesEqual(sr1, target);
+                        if (same != active) {
+                            Split(active & ~same, max_steps);
+                        }
+                    }
+                    if (inst.opcode == O_JSR) {
+                        for (int lane = 0; lane < kLockstepLanes; ++lane) reg[R_R7][lane] = next_pc;
+                    }
+                    pc = target;
+                    break;
+                }
+                case O_TRAP:
+                if (inst.imm == 0x25) {
+                    for (int lane = 0; lane < kLockstepLanes; ++lane) reg[R_R7][lane] = next_pc;
+                    ++steps;
+                    pc = 0;
+                    Finish(active, true);
+                    return;
+                }
+                // Console I/O is sequential by nature
+                Split(active, max_steps);
+                return;
+                case O_RTI:
+                // Interrupt returns and privilege exceptions are left to the scalar machine
+                Split(active, max_steps);
+                return;
+                default:
+                // The reserved opcode does nothing
+                break;
+            }
+            if (inst.opcode != O_BR && inst.opcode != O_JMP && inst.opcode != O_JSR) {
+                pc = next_pc;
+            }
+            ++steps;
+            if (pc == 0) {
+                Finish(active, true);
+            }
+        }
+        Finish(active, false);
+    }
+
+    std::vector<batch_result_tp> RunLockstep(const std::string &program, uint16_t address,
+                                             const std::vector<register_tp> &initial, uint64_t max_steps,
+                                             uint64_t *split_lanes) {
+        std::unique_ptr<memory_tp> image(new memory_tp());
+        image->ReadMemoryFromFile(program, address);
+
+        std::vector<batch_result_tp> results;
+        for (size_t first = 0; first < initial.size(); first += kLockstepLanes) {
+            std::vector<register_tp> lanes(initial.begin() + first,
+                                           initial.begin() + std::min(initial.size(), first + kLockstepLanes));
+            std::unique_ptr<lockstep_machine_tp> machine(new lockstep_machine_tp(*image, address, lanes));
+            machine->Run(max_steps);
+            results.insert(results.end(), machine->result, machine->result + lanes.size());
+            if (split_lanes != nullptr) {
+                *split_lanes += machine->split_lanes;
+            }
+        }
+        return results;
+    }
+}; // virtual machine namespace
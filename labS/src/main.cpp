@@ -6,8 +6,21 @@
  * @Description  : file content
  */
 #include "simulator.h"
+#include "observer.h"
+#include "batch.h"
+#include "lockstep.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "profiler.h"
+#include "cache.h"
+#include "pipeline.h"
+#include "debugger.h"
+#include "gdb_stub.h"
+#include "history.h"
 #include <cstdio>
 #include <ostream>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace virtual_machine_nsp;
 namespace po = boost::program_options;
@@ -18,6 +31,325 @@ std::string gInputFileName = "input.txt";
 std::string gRegisterStatusFileName = "register.txt";
 std::string gOutputFileName = "";
 int gBeginningAddress = 0x3000;
+int gEngine = ENGINE_SWITCH;
+bool gIsFusionReportMode = false;
+bool gIsCountingMode = false;
+std::string gBatchManifestFileName = "";
+std::string gBatchResultFileName = "results.txt";
+std::string gLockstepManifestFileName = "";
+int gThreadCount = 0;
+uint64_t gMaxSteps = UINT64_MAX;
+uint64_t gSnapshotCycle = 0;
+std::string gSnapshotFileName = "snapshot.lc3s";
+std::string gRestoreFileName = "";
+bool gIsTracingMode = false;
+std::string gBinaryTraceFileName = "";
+bool gIsTraceCompressed = false;
+bool gIsProfilingMode = false;
+std::string gFoldedStackFileName = "";
+bool gIsCallGraphMode = false;
+std::string gCallgrindFileName = "";
+std::string gMemoryProfilePrefix = "";
+uint64_t gWorkingSetWindow = 10000;
+std::string gCacheSpec = "";
+std::string gL2CacheSpec = "";
+std::string gCacheLatencySpec = "1:10:100";
+bool gIsPipelineMode = false;
+std::string gPredictorName = "gshare";
+std::string gOpcodeLatencySpec = "";
+uint64_t gMispredictPenalty = 2;
+std::string gOperatingSystemFileName = "";
+std::string gTrapModeName = "native";
+std::string gKeyboardFileName = "";
+std::string gRecordFileName = "";
+std::vector<std::string> gBreakpoints;
+std::vector<std::string> gWriteWatches;
+std::vector<std::string> gReadWatches;
+std::string gReplayFileName = "";
+std::string gGdbAddress = "";
+uint64_t gHistoryInterval = 100000;
+
+// Fill the breakpoints and watchpoints of a debugger from the options
+template <typename Debugger>
+static bool SetDebugAddresses(Debugger &debugger) {
+    const std::pair<const std::vector<std::string> *, address_bitmap_tp *> kinds[] = {
+        {&gBreakpoints, &debugger.breakpoints},
+        {&gWriteWatches, &debugger.write_watches},
+        {&gReadWatches, &debugger.read_watches}};
+    for (const auto &kind : kinds) {
+        for (const std::string &text : *kind.first) {
+            uint16_t address;
+            if (!ParseAddress(text, address)) {
+                std::cerr << "bad address " << text << std::endl;
+                return false;
+            }
+            kind.second->Set(address);
+        }
+    }
+    return true;
+}
+
+// Run at most max_steps instructions with the engine picked by --engine,
+// returning the number of executed instructions
+template <typename Machine, typename Observer>
+static uint64_t RunSteps(Machine &virtual_machine, Observer &observer, uint64_t max_steps) {
+    // Without an observer a trap waiting for input comes back here
+    virtual_machine.yield_on_input = std::is_same<Observer, null_observer_tp>::value;
+    if (gEngine == ENGINE_SWITCH) {
+        // NextStep counts the executed instructions in cycle. A trap stalled
+        // for input returns through a service point, the only place to wait.
+        // With history cycle may also go back, the caller then reads it.
+        uint64_t start = virtual_machine.cycle;
+        uint64_t end = start + std::min(max_steps, UINT64_MAX - start);
+        while (!virtual_machine.halted && virtual_machine.cycle < end) {
+            virtual_machine.RunSwitch(end, observer);
+            if (virtual_machine.input_wait) {
+                virtual_machine.console.WaitForInput();
+                virtual_machine.input_wait = false;
+            }
+        }
+        return virtual_machine.cycle - start;
+    }
+    uint64_t steps = 0;
+    while (!virtual_machine.halted && steps < max_steps) {
+        if (virtual_machine.input_wait) {
+            virtual_machine.console.WaitForInput();
+            virtual_machine.input_wait = false;
+        }
+        steps += virtual_machine.Run(max_steps - steps, observer);
+    }
+    return steps;
+}
+
+// Run the program to completion, saving a snapshot on the way if asked to
+template <typename Machine, typename Observer>
+static uint64_t RunProgram(Machine &virtual_machine, Observer &observer, uint64_t time_flag) {
+    if (gEngine == ENGINE_THREADED && !Observer::kObservesInstructions) {
+        virtual_machine.FuseRange(virtual_machine.image_begin,
+                                  virtual_machine.image_begin + virtual_machine.image_size);
+    }
+    if (gSnapshotCycle > time_flag) {
+        time_flag += RunSteps(virtual_machine, observer, gSnapshotCycle - time_flag);
+        if (time_flag == gSnapshotCycle) {
+            if (!SaveSnapshot(gSnapshotFileName, virtual_machine, time_flag)) {
+                std::cerr << "cannot write snapshot " << gSnapshotFileName << std::endl;
+            }
+        }
+    }
+    return time_flag + RunSteps(virtual_machine, observer, UINT64_MAX);
+}
+
+// The debugger reads its commands from stdin, the program then only
+// gets a keyboard thread for --input. gdb talks over its own socket.
+static bool IsDebugging() {
+    return gGdbAddress.empty() && (gIsSingleStepMode || !gBreakpoints.empty() || !gWriteWatches.empty() ||
+                                   !gReadWatches.empty());
+}
+
+// Run the program under gdb or the built-in debugger, both only watch a
+// flat memory machine
+static int RunDebugger(virtual_machine_tp &virtual_machine, bool has_history, uint64_t &time_flag) {
+    if (!gGdbAddress.empty()) {
+        std::unique_ptr<gdb_stub_tp> stub(new gdb_stub_tp());
+        std::string error;
+        if (!SetDebugAddresses(*stub)) {
+            return 1;
+        }
+        if (!stub->Listen(gGdbAddress, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        if (!stub->Start(virtual_machine)) {
+            std::cerr << "no gdb connection" << std::endl;
+            return 1;
+        }
+        time_flag = RunProgram(virtual_machine, *stub, time_flag);
+        stub->Exited(virtual_machine);
+        return 0;
+    }
+    std::unique_ptr<debug_observer_tp> observer(new debug_observer_tp(std::cin, std::cout, gIsSingleStepMode));
+    if (!SetDebugAddresses(*observer)) {
+        return 1;
+    }
+    std::unique_ptr<history_tp> history;
+    if (has_history) {
+        history.reset(new history_tp(gHistoryInterval));
+        observer->history = history.get();
+    }
+    time_flag = RunProgram(virtual_machine, *observer, time_flag);
+    if (has_history) {
+        // Counted steps include the ones taken again
+        time_flag = virtual_machine.cycle;
+    }
+    return 0;
+}
+
+// Everything after the machine is built, for either memory policy
+template <typename Machine>
+static int RunMachine(Machine &virtual_machine, uint64_t time_flag) {
+    if (gTrapModeName == "os") {
+        virtual_machine.trap_mode = M_OS;
+        if (gOperatingSystemFileName.empty() && gRestoreFileName.empty()) {
+            std::cerr << "trap mode os needs an OS image (--os)" << std::endl;
+            return 1;
+        }
+    }
+    bool is_debugging = IsDebugging();
+    // Going back in time runs the program again: cycle has to be exact
+    // at every instruction and the input has to be logged. Logs that are
+    // recorded or replayed need the same exact cycle.
+    bool has_history = is_debugging && gHistoryInterval > 0;
+    if (has_history || !gRecordFileName.empty() || !gReplayFileName.empty()) {
+        gEngine = ENGINE_SWITCH;
+    }
+    replay_tp replay;
+    if (!gReplayFileName.empty()) {
+        // All input comes from the log, already in memory
+        std::string error;
+        if (!replay.Load(gReplayFileName, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        virtual_machine.UseReplay(&replay);
+    } else {
+        // The keyboard is read ahead on its own thread, started by the
+        // first keyboard access
+        int keyboard_fd = STDIN_FILENO;
+        if (!gKeyboardFileName.empty()) {
+            keyboard_fd = open(gKeyboardFileName.c_str(), O_RDONLY);
+            if (keyboard_fd < 0) {
+                std::cerr << "cannot open input " << gKeyboardFileName << std::endl;
+                return 1;
+            }
+        }
+        if (!is_debugging || !gKeyboardFileName.empty()) {
+            virtual_machine.console.UseReader(keyboard_fd);
+        }
+        if (!gRecordFileName.empty() || has_history) {
+            virtual_machine.UseReplay(&replay);
+        }
+    }
+    if (!gOperatingSystemFileName.empty() && gRestoreFileName.empty() &&
+        !virtual_machine.LoadOperatingSystem(gOperatingSystemFileName)) {
+        std::cerr << "cannot load OS image " << gOperatingSystemFileName << std::endl;
+        return 1;
+    }
+    std::ofstream f;
+    f.open(gOutputFileName);
+    uint64_t modelled_cycles = 0;
+    // The observer is picked once, each one has its own execution core
+    if (!gGdbAddress.empty() || is_debugging) {
+        // main restores debug sessions into a flat machine
+        if constexpr (std::is_same<Machine, virtual_machine_tp>::value) {
+            int status = RunDebugger(virtual_machine, has_history, time_flag);
+            if (status != 0) {
+                return status;
+            }
+        }
+    } else if (gIsDetailedMode) {
+        detail_observer_tp observer(f);
+        time_flag = RunProgram(virtual_machine, observer, time_flag);
+    } else if (!gBinaryTraceFileName.empty()) {
+        std::unique_ptr<trace_writer_tp> writer = trace_writer_tp::Open(gBinaryTraceFileName, time_flag, virtual_machine.reg,
+                                                                          gIsTraceCompressed);
+        if (writer == nullptr) {
+            std::cerr << "cannot write trace " << gBinaryTraceFileName << std::endl;
+            return 1;
+        }
+        binary_trace_observer_tp observer(*writer, virtual_machine.reg);
+        time_flag = RunProgram(virtual_machine, observer, time_flag);
+        writer->Close();
+    } else if (gIsTracingMode) {
+        tracing_observer_tp observer(gOutputFileName.empty() ? std::cout : f);
+        time_flag = RunProgram(virtual_machine, observer, time_flag);
+    } else if (gIsProfilingMode) {
+        std::unique_ptr<profile_observer_tp> observer(new profile_observer_tp());
+        time_flag = RunProgram(virtual_machine, *observer, time_flag);
+        observer->PrintReport(std::cout, virtual_machine);
+        if (!gFoldedStackFileName.empty()) {
+            std::ofstream folded(gFoldedStackFileName);
+            observer->WriteFoldedStacks(folded);
+        }
+    } else if (gIsCallGraphMode) {
+        std::unique_ptr<call_graph_observer_tp> observer(new call_graph_observer_tp(virtual_machine.reg[R_PC]));
+        time_flag = RunProgram(virtual_machine, *observer, time_flag);
+        observer->Finish();
+        observer->PrintReport(std::cout);
+        if (!gCallgrindFileName.empty()) {
+            std::ofstream callgrind(gCallgrindFileName);
+            observer->WriteCallgrind(callgrind, gRestoreFileName.empty() ? gInputFileName : gRestoreFileName);
+        }
+    } else if (!gMemoryProfilePrefix.empty()) {
+        std::unique_ptr<memory_observer_tp> observer(new memory_observer_tp(gWorkingSetWindow));
+        time_flag = RunProgram(virtual_machine, *observer, time_flag);
+        observer->PrintReport(std::cout);
+        if (!observer->WriteFiles(gMemoryProfilePrefix)) {
+            std::cerr << "cannot write " << gMemoryProfilePrefix << ".*" << std::endl;
+        }
+    } else if (!gCacheSpec.empty()) {
+        cache_config_tp l1_config, l2_config;
+        uint64_t memory_latency = 100;
+        std::string error;
+        if (!ParseCacheConfig(gCacheSpec, l1_config, error) ||
+            (!gL2CacheSpec.empty() && !ParseCacheConfig(gL2CacheSpec, l2_config, error))) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        if (!ParseCacheLatency(gCacheLatencySpec, l1_config, l2_config, memory_latency, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        std::unique_ptr<cache_observer_tp> observer(
+            new cache_observer_tp(l1_config, gL2CacheSpec.empty() ? nullptr : &l2_config, memory_latency));
+        time_flag = RunProgram(virtual_machine, *observer, time_flag);
+        observer->PrintReport(std::cout);
+        modelled_cycles = observer->modelled_cycles;
+    } else if (gIsPipelineMode) {
+        pipeline_config_tp config;
+        config.mispredict_penalty = gMispredictPenalty;
+        std::string error;
+        std::unique_ptr<branch_predictor_tp> predictor = MakeBranchPredictor(gPredictorName);
+        if (predictor == nullptr) {
+            std::cerr << "unknown branch predictor " << gPredictorName << std::endl;
+            return 1;
+        }
+        if (!gOpcodeLatencySpec.empty() && !ParseOpcodeLatencies(gOpcodeLatencySpec, config, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        pipeline_observer_tp observer(config, std::move(predictor));
+        time_flag = RunProgram(virtual_machine, observer, time_flag);
+        observer.PrintReport(std::cout);
+        modelled_cycles = observer.Cycles();
+    } else if (gIsCountingMode) {
+        counting_observer_tp observer;
+        time_flag = RunProgram(virtual_machine, observer, time_flag);
+        observer.PrintReport(std::cout);
+    } else {
+        null_observer_tp observer;
+        time_flag = RunProgram(virtual_machine, observer, time_flag);
+    }
+
+    virtual_machine.console.Flush();
+    if (!gRecordFileName.empty() && gReplayFileName.empty() && !replay.Save(gRecordFileName)) {
+        std::cerr << "cannot write replay log " << gRecordFileName << std::endl;
+    }
+    if (replay.diverged) {
+        std::cerr << "replay diverged at cycle " << replay.diverged_cycle << std::endl;
+    } else if (!replay.recording && replay.interrupt_position != replay.interrupts.size()) {
+        std::cerr << "replay diverged: " << replay.interrupts.size() - replay.interrupt_position
+                  << " recorded interrupts were not taken" << std::endl;
+    }
+    std::cout << virtual_machine.reg << std::endl;
+    std::cout << "cycle = " << time_flag << std::endl;
+    if (modelled_cycles != 0) {
+        std::cout << "modelled cycle = " << modelled_cycles << std::endl;
+    }
+    if (gIsFusionReportMode) {
+        virtual_machine.PrintFusionReport(std::cout);
+    }
+    return 0;
+}
 
 int main(int argc, char **argv) {
     po::options_description desc{"\e[1mLC3 SIMULATOR\e[0m\n\n\e[1mOptions\e[0m"};
@@ -26,9 +358,46 @@ int main(int argc, char **argv) {
         ("file,f", po::value<std::string>()->default_value("input.txt"), "Input file")             //
         ("register,r", po::value<std::string>()->default_value("register.txt"), "Register Status") //
         ("single,s", "Single Step Mode")                                                           //
+        ("break", po::value<std::vector<std::string>>()->composing(), "Stop before the instruction at this address (repeatable)")
+        ("watch", po::value<std::vector<std::string>>()->composing(), "Stop before a write to this address (repeatable)")
+        ("watch-read", po::value<std::vector<std::string>>()->composing(), "Stop before a read of this address (repeatable)")
+        ("history-interval", po::value<uint64_t>()->default_value(100000), "Instructions between the snapshots of the debugger for reverse execution (0: off)")
+        ("gdb", po::value<std::string>(), "Wait for a gdb remote connection on this 127.0.0.1 port or Unix socket path")
         ("begin,b", po::value<int>()->default_value(0x3000), "Begin address (0x3000)")
         ("output,o", po::value<std::string>()->default_value(""), "Output file")
-        ("detail,d", "Detailed Mode");
+        ("detail,d", "Detailed Mode")
+        ("engine,e", po::value<std::string>()->default_value("switch"), "Run engine (switch, threaded)")
+        ("fusion", "Report superinstructions (threaded engine)")
+        ("count", "Count executed instructions per opcode")
+        ("profile", "Profile executions per address, opcode, branch and loop")
+        ("folded", po::value<std::string>(), "Write the profile as folded stacks for flamegraph.pl (implies --profile)")
+        ("call-graph", "Profile inclusive and exclusive instructions per subroutine")
+        ("callgrind", po::value<std::string>(), "Write the call graph profile in callgrind format (implies --call-graph)")
+        ("memory-profile", po::value<std::string>(), "Write per word access counts, a heatmap and the working set to <prefix>.*")
+        ("working-set-window", po::value<uint64_t>()->default_value(10000), "Window of the working set in instructions")
+        ("cache", po::value<std::string>(), "Model an L1 cache, size:ways:line[:lru|fifo][:wb|wt] in words")
+        ("l2-cache", po::value<std::string>(), "Model an L2 cache behind the L1, same format")
+        ("cache-latency", po::value<std::string>()->default_value("1:10:100"), "L1:L2:memory latencies in cycles")
+        ("pipeline", "Model a five stage pipeline and report CPI, stalls and mispredictions")
+        ("predictor", po::value<std::string>()->default_value("gshare"), "Branch predictor of the pipeline (static, bimodal, gshare)")
+        ("opcode-latency", po::value<std::string>(), "Pipeline cycles per opcode, e.g. LDI=3,TRAP=10")
+        ("mispredict-penalty", po::value<uint64_t>()->default_value(2), "Pipeline cycles lost per misprediction")
+        ("os", po::value<std::string>(), "Load an LC-3 OS image (memory file at x0000 or .obj) with its trap vector table")
+        ("trap-mode", po::value<std::string>()->default_value("native"), "Service traps natively or through the OS image (native, os)")
+        ("input,i", po::value<std::string>(), "Read the keyboard from this file or pipe instead of stdin")
+        ("record", po::value<std::string>(), "Log the input and interrupts of this run for --replay")
+        ("replay", po::value<std::string>(), "Run again with the input of a --record log, without reading the keyboard")
+        ("trace", "Trace executed addresses and instructions to the output file")
+        ("binary-trace", po::value<std::string>(), "Write a binary trace of every step to this file (render with lc3trace)")
+        ("compress-trace", "Write the binary trace as delta encoded, compressed chunks with a seek index")
+        ("batch", po::value<std::string>(), "Run every job of a manifest (program [register file [input file]] per line)")
+        ("lockstep", po::value<std::string>(), "Run the program over every register file listed in a manifest, in lockstep")
+        ("results", po::value<std::string>()->default_value("results.txt"), "Result file of the batch and lockstep modes")
+        ("threads", po::value<int>()->default_value(0), "Worker threads of the batch mode (0: one per core)")
+        ("max-steps", po::value<uint64_t>(), "Stop a batch job or lane after this many instructions")
+        ("save-snapshot-at", po::value<uint64_t>(), "Save a snapshot once this cycle is reached")
+        ("snapshot-file", po::value<std::string>()->default_value("snapshot.lc3s"), "Snapshot file to save")
+        ("restore", po::value<std::string>(), "Start from a snapshot instead of the input and register files");
 
     po::variables_map vm;
     store(parse_command_line(argc, argv, desc), vm);
@@ -46,6 +415,21 @@ int main(int argc, char **argv) {
     if (vm.count("single")) {
         gIsSingleStepMode = true;
     }
+    if (vm.count("break")) {
+        gBreakpoints = vm["break"].as<std::vector<std::string>>();
+    }
+    if (vm.count("watch")) {
+        gWriteWatches = vm["watch"].as<std::vector<std::string>>();
+    }
+    if (vm.count("watch-read")) {
+        gReadWatches = vm["watch-read"].as<std::vector<std::string>>();
+    }
+    if (vm.count("history-interval")) {
+        gHistoryInterval = vm["history-interval"].as<uint64_t>();
+    }
+    if (vm.count("gdb")) {
+        gGdbAddress = vm["gdb"].as<std::string>();
+    }
     if (vm.count("begin")) {
         gBeginningAddress = vm["begin"].as<int>();
     }
@@ -55,24 +439,189 @@ int main(int argc, char **argv) {
     if (vm.count("detail")) {
         gIsDetailedMode = true;
     }
+    if (vm.count("engine")) {
+        std::string engine = vm["engine"].as<std::string>();
+        if (engine == "switch") {
+            gEngine = ENGINE_SWITCH;
+        } else if (engine == "threaded") {
+            gEngine = ENGINE_THREADED;
+        } else {
+            std::cerr << "unknown engine: " << engine << std::endl;
+            return 1;
+        }
+    }
+    if (vm.count("fusion")) {
+        gIsFusionReportMode = true;
+    }
+    if (vm.count("count")) {
+        gIsCountingMode = true;
+    }
+    if (vm.count("profile")) {
+        gIsProfilingMode = true;
+    }
+    if (vm.count("folded")) {
+        gIsProfilingMode = true;
+        gFoldedStackFileName = vm["folded"].as<std::string>();
+    }
+    if (vm.count("call-graph")) {
+        gIsCallGraphMode = true;
+    }
+    if (vm.count("callgrind")) {
+        gIsCallGraphMode = true;
+        gCallgrindFileName = vm["callgrind"].as<std::string>();
+    }
+    if (vm.count("memory-profile")) {
+        gMemoryProfilePrefix = vm["memory-profile"].as<std::string>();
+    }
+    if (vm.count("cache")) {
+        gCacheSpec = vm["cache"].as<std::string>();
+    }
+    if (vm.count("l2-cache")) {
+        gL2CacheSpec = vm["l2-cache"].as<std::string>();
+    }
+    if (vm.count("cache-latency")) {
+        gCacheLatencySpec = vm["cache-latency"].as<std::string>();
+    }
+    if (vm.count("pipeline")) {
+        gIsPipelineMode = true;
+    }
+    if (vm.count("predictor")) {
+        gPredictorName = vm["predictor"].as<std::string>();
+    }
+    if (vm.count("opcode-latency")) {
+        gOpcodeLatencySpec = vm["opcode-latency"].as<std::string>();
+    }
+    if (vm.count("mispredict-penalty")) {
+        gMispredictPenalty = vm["mispredict-penalty"].as<uint64_t>();
+    }
+    if (vm.count("working-set-window")) {
+        gWorkingSetWindow = std::max<uint64_t>(1, vm["working-set-window"].as<uint64_t>());
+    }
+    if (vm.count("os")) {
+        gOperatingSystemFileName = vm["os"].as<std::string>();
+    }
+    if (vm.count("trap-mode")) {
+        gTrapModeName = vm["trap-mode"].as<std::string>();
+        if (gTrapModeName != "native" && gTrapModeName != "os") {
+            std::cerr << "unknown trap mode: " << gTrapModeName << std::endl;
+            return 1;
+        }
+    }
+    if (vm.count("input")) {
+        gKeyboardFileName = vm["input"].as<std::string>();
+    }
+    if (vm.count("record")) {
+        gRecordFileName = vm["record"].as<std::string>();
+    }
+    if (vm.count("replay")) {
+        gReplayFileName = vm["replay"].as<std::string>();
+    }
+    if (vm.count("trace")) {
+        gIsTracingMode = true;
+    }
+    if (vm.count("binary-trace")) {
+        gBinaryTraceFileName = vm["binary-trace"].as<std::string>();
+    }
+    if (vm.count("compress-trace")) {
+        gIsTraceCompressed = true;
+    }
+    if (vm.count("batch")) {
+        gBatchManifestFileName = vm["batch"].as<std::string>();
+    }
+    if (vm.count("lockstep")) {
+        gLockstepManifestFileName = vm["lockstep"].as<std::string>();
+    }
+    if (vm.count("results")) {
+        gBatchResultFileName = vm["results"].as<std::string>();
+    }
+    if (vm.count("threads")) {
+        gThreadCount = vm["threads"].as<int>();
+    }
+    if (vm.count("max-steps")) {
+        gMaxSteps = vm["max-steps"].as<uint64_t>();
+    }
+    if (vm.count("save-snapshot-at")) {
+        gSnapshotCycle = vm["save-snapshot-at"].as<uint64_t>();
+    }
+    if (vm.count("snapshot-file")) {
+        gSnapshotFileName = vm["snapshot-file"].as<std::string>();
+    }
+    if (vm.count("restore")) {
+        gRestoreFileName = vm["restore"].as<std::string>();
+    }
 
-    virtual_machine_tp virtual_machine(gBeginningAddress, gInputFileName, gRegisterStatusFileName);
-    int halt_flag = true;
-    int time_flag = 0;
-    std::ofstream f;
-    f.open(gOutputFileName);
-    while(halt_flag) {
-        halt_flag=virtual_machine.NextStep();
-        // Single step
-        // TO BE DONEd
-        if (gIsDetailedMode){
-            std::cout << virtual_machine.reg << std::endl;
-            f<<virtual_machine.reg<<std::endl;
+    // A run has a single observer, options asking for different ones conflict
+    const std::pair<bool, const char *> kObserverOptions[] = {
+        {!gGdbAddress.empty(), "--gdb"},
+        {IsDebugging(), "--single, --break or --watch"},
+        {gIsDetailedMode, "--detail"},
+        {!gBinaryTraceFileName.empty(), "--binary-trace"},
+        {gIsTracingMode, "--trace"},
+        {gIsProfilingMode, "--profile"},
+        {gIsCallGraphMode, "--call-graph"},
+        {!gMemoryProfilePrefix.empty(), "--memory-profile"},
+        {!gCacheSpec.empty(), "--cache"},
+        {gIsPipelineMode, "--pipeline"},
+        {gIsCountingMode, "--count"}};
+    const char *observer_option = nullptr;
+    for (const auto &option : kObserverOptions) {
+        if (!option.first) {
+            continue;
         }
-        ++time_flag;
+        if (observer_option != nullptr) {
+            std::cerr << observer_option << " and " << option.second << " cannot be used together" << std::endl;
+            return 1;
+        }
+        observer_option = option.second;
     }
 
-    std::cout << virtual_machine.reg << std::endl;
-    std::cout << "cycle = " << time_flag << std::endl;
-    return 0;
+    if (!gBatchManifestFileName.empty()) {
+        size_t thread_count = gThreadCount > 0 ? gThreadCount : std::thread::hardware_concurrency();
+        int failed = RunBatch(gBatchManifestFileName, gBatchResultFileName, thread_count,
+                              gBeginningAddress, gMaxSteps);
+        return failed == 0 ? 0 : 1;
+    }
+    if (!gLockstepManifestFileName.empty()) {
+        std::vector<std::string> register_files;
+        std::vector<register_tp> initial;
+        std::ifstream manifest(gLockstepManifestFileName);
+        std::string register_file;
+        while (manifest >> register_file) {
+            register_files.push_back(register_file);
+            initial.push_back(ReadRegisterFile(register_file));
+        }
+        uint64_t split_lanes = 0;
+        std::vector<batch_result_tp> results =
+            RunLockstep(gInputFileName, gBeginningAddress, initial, gMaxSteps, &split_lanes);
+        std::ofstream out(gBatchResultFileName);
+        for (size_t index = 0; index < results.size(); ++index) {
+            WriteBatchResult(out, index, register_files[index], results[index]);
+        }
+        std::cout << "lanes = " << results.size() << ", split = " << split_lanes << std::endl;
+        return 0;
+    }
+
+    if (!gRestoreFileName.empty()) {
+        // Warm start: the paged memory reads the snapshot pages in place
+        // and copies a page on its first write. The debuggers only watch
+        // a flat memory, a debugged restore copies the image in.
+        snapshot_tp snapshot;
+        std::string error;
+        if (!LoadSnapshot(gRestoreFileName, snapshot, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        if (!gGdbAddress.empty() || IsDebugging()) {
+            std::unique_ptr<virtual_machine_tp> machine(new virtual_machine_tp(snapshot.reg[R_PC], snapshot.image, ""));
+            RestoreSnapshot(*machine, snapshot);
+            return RunMachine(*machine, snapshot.cycle);
+        }
+        std::unique_ptr<paged_virtual_machine_tp> machine(
+            new paged_virtual_machine_tp(snapshot.reg[R_PC], snapshot.image, ""));
+        RestoreSnapshot(*machine, snapshot);
+        return RunMachine(*machine, snapshot.cycle);
+    }
+    std::unique_ptr<virtual_machine_tp> machine(
+        new virtual_machine_tp(gBeginningAddress, gInputFileName, gRegisterStatusFileName));
+    return RunMachine(*machine, 0);
 }
\ No newline at end of file
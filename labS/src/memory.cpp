@@ -8,31 +8,247 @@
 #include "common.h"
 #include "memory.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace virtual_machine_nsp {
-    void memory_tp::ReadMemoryFromFile(std::string filename, int beginning_address) {
-        // Read from the file
-        // TO BE DONE
-        std::ifstream in(filename);
-        int add=beginning_address;
-        std::string temp="";
-        while(std::getline(in,temp)){
-            unsigned int t=0;
-            for(int i=0;i<16;i++){
-                t+=((temp[i] -'0') << (15-i));
+    static bool TranslateBinaryLine(const char *line, int16_t &result) {
+#ifdef __SSE2__
+        // Reverse the bytes so the first character lands in bit 15 of the
+        // movemask, then compare all 16 characters at once
+        __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(line));
+        chars = _mm_shuffle_epi32(chars, _MM_SHUFFLE(1, 0, 3, 2));
+        chars = _mm_shufflelo_epi16(chars, _MM_SHUFFLE(0, 1, 2, 3));
+        chars = _mm_shufflehi_epi16(chars, _MM_SHUFFLE(0, 1, 2, 3));
+        chars = _mm_or_si128(_mm_srli_epi16(chars, 8), _mm_slli_epi16(chars, 8));
+        const __m128i one = _mm_set1_epi8('1');
+        const __m128i low_bit = _mm_set1_epi8(1);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(chars, low_bit), one)) != 0xFFFF) {
+            return false;
+        }
+        result = int16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chars, one)));
+        return true;
+#else
+        unsigned int word = 0;
+        for (int index = 0; index < kInstructionLength; ++index) {
+            if ((line[index] | 1) != '1') {
+                return false;
+            }
+            word = (word << 1) | (line[index] & 1);
+        }
+        result = int16_t(word);
+        return true;
+#endif
+    }
+
+    static bool TranslateHexLine(const char *line, size_t length, int16_t &result) {
+        if (length >= 2 && line[0] == '0' && (line[1] == 'x' || line[1] == 'X')) {
+            line += 2;
+            length -= 2;
+        } else if (length >= 1 && (line[0] == 'x' || line[0] == 'X')) {
+            line += 1;
+            length -= 1;
+        }
+        if (length == 0 || length > 4) {
+            return false;
+        }
+        unsigned int word = 0;
+        for (size_t index = 0; index < length; ++index) {
+            char c = line[index];
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                digit = (c | 0x20) - 'a' + 10;
+            } else {
+                return false;
+            }
+            word = (word << 4) | digit;
+        }
+        result = int16_t(word);
+        return true;
+    }
+
+    bool TranslateLine(const char *line, size_t length, int16_t &result) {
+        while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r')) {
+            --length;
+        }
+        // As in the original reader only the first 16 characters of a
+        // binary line count, a comment may follow them
+        if (length >= kInstructionLength && TranslateBinaryLine(line, result)) {
+            return true;
+        }
+        return TranslateHexLine(line, length, result);
+    }
+
+    std::vector<int16_t> ReadWordsFromFile(const std::string &filename) {
+        std::vector<int16_t> words;
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return words;
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size == 0) {
+            close(fd);
+            return words;
+        }
+        size_t size = status.st_size;
+        void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            return words;
+        }
+        const char *text = static_cast<const char *>(address);
+        const char *end = text + size;
+        words.reserve(size / (kInstructionLength + 1) + 1);
+        int line_number = 0;
+        while (text < end) {
+            ++line_number;
+            const char *newline = static_cast<const char *>(memchr(text, '\n', end - text));
+            const char *line_end = newline ? newline : end;
+            size_t length = line_end - text;
+            if (length > 0 && text[length - 1] == '\r') {
+                --length;
+            }
+            if (length > 0) {
+                int16_t word = 0;
+                if (!TranslateLine(text, length, word)) {
+                    std::cerr << filename << ": bad memory line " << line_number << std::endl;
+                }
+                words.push_back(word);
+            }
+            text = line_end + 1;
+        }
+        munmap(address, size);
+        return words;
+    }
+
+    std::vector<int16_t> ReadObjectFile(const std::string &filename, uint16_t &origin) {
+        std::vector<int16_t> words;
+        std::ifstream in(filename, std::ios::binary);
+        unsigned char bytes[2];
+        bool first = true;
+        while (in.read(reinterpret_cast<char *>(bytes), 2)) {
+            int16_t word = int16_t(bytes[0] << 8 | bytes[1]);
+            if (first) {
+                origin = word;
+                first = false;
+            } else {
+                words.push_back(word);
+            }
+        }
+        return words;
+    }
+
+    int memory_tp::ReadMemoryFromFile(std::string filename, int beginning_address) {
+        std::vector<int16_t> words = ReadWordsFromFile(filename);
+        for (size_t index = 0; index < words.size(); ++index) {
+            memory[uint16_t(beginning_address + index)] = words[index];
+        }
+        return words.size();
+    }
+
+    void memory_tp::LoadImage(const std::shared_ptr<const memory_image_tp> &image) {
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            memcpy(memory + index * kMemoryPageSize, image->Page(index), sizeof(int16_t) * kMemoryPageSize);
+        }
+    }
+
+    memory_image_tp::memory_image_tp() {
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            pages[index] = ZeroPage();
+        }
+    }
+
+    const int16_t *memory_image_tp::ZeroPage() {
+        static const int16_t kZeroPage[kMemoryPageSize] = {};
+        return kZeroPage;
+    }
+
+    std::shared_ptr<const memory_image_tp> memory_image_tp::Empty() {
+        static const std::shared_ptr<const memory_image_tp> kEmpty(new memory_image_tp());
+        return kEmpty;
+    }
+
+    std::shared_ptr<const memory_image_tp> memory_image_tp::FromFile(const std::string &filename, int beginning_address) {
+        std::shared_ptr<memory_image_tp> image(new memory_image_tp());
+        std::vector<int16_t> words = ReadWordsFromFile(filename);
+        for (size_t index = 0; index < words.size(); ++index) {
+            image->SetContent(beginning_address + index, words[index]);
+        }
+        image->image_begin = beginning_address;
+        image->image_size = words.size();
+        return image;
+    }
+
+    void memory_image_tp::SetContent(int address, int16_t value) {
+        int index = PageIndex(address);
+        if (IsZeroPage(index)) {
+            storage.emplace_back(new int16_t[kMemoryPageSize]());
+            pages[index] = storage.back().get();
+        }
+        const_cast<int16_t *>(pages[index])[PageOffset(address)] = value;
+    }
+
+    void memory_image_tp::SetPage(int index, const int16_t *page, const std::shared_ptr<const void> &page_owner) {
+        pages[index] = page;
+        owner = page_owner;
+    }
+
+    paged_memory_tp::paged_memory_tp() {
+        LoadImage(memory_image_tp::Empty());
+    }
+
+    paged_memory_tp::paged_memory_tp(const paged_memory_tp &other) {
+        *this = other;
+    }
+
+    paged_memory_tp &paged_memory_tp::operator=(const paged_memory_tp &other) {
+        if (this == &other) {
+            return *this;
+        }
+        LoadImage(other.base);
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            if (other.private_pages[index] != nullptr) {
+                CopyPage(index);
+                memcpy(private_pages[index].get(), other.private_pages[index].get(), sizeof(int16_t) * kMemoryPageSize);
             }
-            memory[beginning_address++] =t;
         }
+        return *this;
     }
 
-    int16_t memory_tp::GetContent(int address) const {
-        // get the content
-        // TO BE DONE
-        return memory[address];
+    int paged_memory_tp::ReadMemoryFromFile(std::string filename, int beginning_address) {
+        std::vector<int16_t> words = ReadWordsFromFile(filename);
+        for (size_t index = 0; index < words.size(); ++index) {
+            (*this)[uint16_t(beginning_address + index)] = words[index];
+        }
+        return words.size();
     }
 
-    int16_t& memory_tp::operator[](int address) {
-        // get the content
-        // TO BE DONE
-        return memory[address];
-    }    
+    void paged_memory_tp::LoadImage(const std::shared_ptr<const memory_image_tp> &image) {
+        base = image;
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            private_pages[index].reset();
+            read_pages[index] = base->Page(index);
+        }
+    }
+
+    void paged_memory_tp::CopyPage(int index) {
+        private_pages[index].reset(new int16_t[kMemoryPageSize]);
+        memcpy(private_pages[index].get(), read_pages[index], sizeof(int16_t) * kMemoryPageSize);
+        read_pages[index] = private_pages[index].get();
+    }
+
+    int paged_memory_tp::PrivatePageCount() const {
+        int count = 0;
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            count += private_pages[index] != nullptr;
+        }
+        return count;
+    }
 }; // virtual machine namespace
@@ -0,0 +1,55 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-11-26 10:12:40
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-11-26 10:12:40
+ * @Description  : observer policies for the execution core
+ */
+#include "observer.h"
+
+#include <iomanip>
+
+namespace virtual_machine_nsp {
+    template <typename Machine>
+    void detail_observer_tp::BeforeExecute(Machine &vm, uint16_t, const instruction_tp &inst) {
+        if (kOpcodeName[inst.opcode] != nullptr) {
+            std::cout << kOpcodeName[inst.opcode] << std::endl;
+        }
+        // Jumps also show where they come from and where they go
+        if (inst.opcode == O_BR || (inst.opcode == O_JSR && inst.flag)) {
+            std::cout << vm.reg[R_PC] << std::endl;
+            std::cout << inst.imm << std::endl;
+        } else if (inst.opcode == O_JMP || inst.opcode == O_JSR) {
+            std::cout << vm.reg[R_PC] << std::endl;
+            std::cout << vm.reg[inst.sr1] << std::endl;
+        }
+    }
+    template void detail_observer_tp::BeforeExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void detail_observer_tp::BeforeExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+
+    template <typename Machine>
+    void detail_observer_tp::AfterExecute(Machine &vm, uint16_t, const instruction_tp &) {
+        std::cout << vm.reg << std::endl;
+        file << vm.reg << std::endl;
+    }
+    template void detail_observer_tp::AfterExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void detail_observer_tp::AfterExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+
+    void counting_observer_tp::PrintReport(std::ostream &os) const {
+        os << "instructions per opcode:" << std::endl;
+        for (int opcode = 0; opcode < 16; ++opcode) {
+            if (kOpcodeName[opcode] != nullptr && opcode_count[opcode] != 0) {
+                os << "  " << std::left << std::setw(5) << kOpcodeName[opcode] << std::right << std::dec
+                   << opcode_count[opcode] << std::endl;
+            }
+        }
+    }
+
+    template <typename Machine>
+    void tracing_observer_tp::BeforeExecute(Machine &, uint16_t pc, const instruction_tp &inst) {
+        os << std::hex << std::setfill('0') << std::setw(4) << pc << ": " << std::setw(4) << uint16_t(inst.inst)
+           << std::setfill(' ') << '\n';
+    }
+    template void tracing_observer_tp::BeforeExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void tracing_observer_tp::BeforeExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+}; // virtual machine namespace
@@ -0,0 +1,147 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-12 14:26:08
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-12 14:26:08
+ * @Description  : five stage pipeline timing model and branch predictors
+ */
+#include "pipeline.h"
+
+#include <iomanip>
+
+namespace virtual_machine_nsp {
+    std::unique_ptr<branch_predictor_tp> MakeBranchPredictor(const std::string &name) {
+        if (name == "static") {
+            return std::unique_ptr<branch_predictor_tp>(new static_predictor_tp());
+        }
+        if (name == "bimodal" || name == "2bit") {
+            return std::unique_ptr<branch_predictor_tp>(new bimodal_predictor_tp());
+        }
+        if (name == "gshare") {
+            return std::unique_ptr<branch_predictor_tp>(new gshare_predictor_tp());
+        }
+        return nullptr;
+    }
+
+    bool ParseOpcodeLatencies(const std::string &text, pipeline_config_tp &config, std::string &error) {
+        std::stringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            size_t equal = item.find('=');
+            std::string name = item.substr(0, equal);
+            int opcode = 0;
+            while (opcode < 16 && (kOpcodeName[opcode] == nullptr || name != kOpcodeName[opcode])) {
+                ++opcode;
+            }
+            if (equal == std::string::npos || opcode == 16) {
+                error = "opcode latency \"" + item + "\": expected NAME=cycles with an opcode name such as LDR";
+                return false;
+            }
+            try {
+                config.latency[opcode] = std::max(1, std::stoi(item.substr(equal + 1)));
+            } catch (const std::exception &) {
+                error = "opcode latency \"" + item + "\": cycles must be a number";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Registers, and the condition codes as bit kCondBit, an instruction reads
+    static uint32_t ReadMask(const instruction_tp &inst) {
+        const int cond = pipeline_observer_tp::kCondBit;
+        switch (inst.opcode) {
+            case O_ADD:
+            case O_AND: return (1u << inst.sr1) | (inst.flag ? 0 : 1u << inst.sr2);
+            case O_NOT: return 1u << inst.sr1;
+            case O_LDR: return 1u << inst.sr1;
+            case O_STR: return (1u << inst.sr1) | (1u << inst.dr);
+            case O_ST:
+            case O_STI: return 1u << inst.dr;
+            case O_JMP: return 1u << inst.sr1;
+            case O_JSR: return inst.flag ? 0 : 1u << inst.sr1;
+            case O_BR:  return inst.dr != 0 ? 1u << cond : 0;
+            case O_TRAP: return inst.imm == 0x21 || inst.imm == 0x22 ? 1u : 0;
+            default: return 0;
+        }
+    }
+
+    template <typename Machine>
+    void pipeline_observer_tp::BeforeExecute(Machine &, uint16_t, const instruction_tp &inst) {
+        ++instructions;
+        if (ReadMask(inst) & loaded) {
+            load_use_stalls += config.load_use_penalty;
+        }
+        latency_stalls += config.latency[inst.opcode] - 1;
+        bool load = inst.opcode == O_LD || inst.opcode == O_LDR || inst.opcode == O_LDI;
+        loaded = load ? (1u << inst.dr) | (1u << kCondBit) : 0;
+    }
+    template void pipeline_observer_tp::BeforeExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void pipeline_observer_tp::BeforeExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+
+    bool pipeline_observer_tp::PredictTarget(uint16_t pc, uint16_t target) {
+        int slot = pc % kTargetBufferSize;
+        bool hit = target_buffer_pc[slot] == pc && target_buffer[slot] == target;
+        target_buffer_pc[slot] = pc;
+        target_buffer[slot] = target;
+        return hit;
+    }
+
+    template <typename Machine>
+    void pipeline_observer_tp::AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst) {
+        uint16_t next = vm.reg[R_PC];
+        if (inst.opcode == O_BR && inst.dr != 0) {
+            // The bits 11-9 of BR are n, z and p
+            bool taken = next != uint16_t(pc + 1);
+            ++branch_count;
+            branch_mispredicts += predictor->Predict(pc, pc + 1 + inst.imm) != taken;
+            predictor->Update(pc, taken);
+        } else if (inst.opcode == O_JSR) {
+            ++jump_count;
+            jump_mispredicts += !PredictTarget(pc, next);
+            return_stack[return_top++ % kReturnStackSize] = pc + 1;
+        } else if (inst.opcode == O_JMP && inst.sr1 == R_R7) {
+            ++return_count;
+            bool hit = return_top > 0 && return_stack[--return_top % kReturnStackSize] == next;
+            return_mispredicts += !hit;
+        } else if (inst.opcode == O_JMP) {
+            ++jump_count;
+            jump_mispredicts += !PredictTarget(pc, next);
+        }
+    }
+    template void pipeline_observer_tp::AfterExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void pipeline_observer_tp::AfterExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+
+    uint64_t pipeline_observer_tp::Cycles() const {
+        uint64_t mispredicts = branch_mispredicts + jump_mispredicts + return_mispredicts;
+        return instructions + (instructions ? kStageCount - 1 : 0) + load_use_stalls + latency_stalls +
+               mispredicts * config.mispredict_penalty;
+    }
+
+    static double Ratio(uint64_t part, uint64_t total) {
+        return total == 0 ? 0.0 : 100.0 * part / total;
+    }
+
+    void pipeline_observer_tp::PrintReport(std::ostream &os) const {
+        uint64_t cycles = Cycles();
+        uint64_t mispredicts = branch_mispredicts + jump_mispredicts + return_mispredicts;
+        os << std::dec << std::fixed << std::setprecision(3);
+        os << "pipeline: " << instructions << " instructions, " << cycles << " cycles, CPI "
+           << (instructions == 0 ? 0.0 : double(cycles) / instructions) << std::endl;
+        os << std::setprecision(2);
+        os << "  fill             " << std::setw(12) << (instructions ? kStageCount - 1 : 0) << std::endl;
+        os << "  load use stalls  " << std::setw(12) << load_use_stalls << std::setw(8)
+           << Ratio(load_use_stalls, cycles) << "%" << std::endl;
+        os << "  latency stalls   " << std::setw(12) << latency_stalls << std::setw(8)
+           << Ratio(latency_stalls, cycles) << "%" << std::endl;
+        os << "  mispredictions   " << std::setw(12) << mispredicts * config.mispredict_penalty << std::setw(8)
+           << Ratio(mispredicts * config.mispredict_penalty, cycles) << "%" << std::endl;
+        os << "  branches " << std::setw(12) << branch_count << ", mispredicted " << std::setw(10)
+           << branch_mispredicts << std::setw(8) << Ratio(branch_mispredicts, branch_count) << "%" << std::endl;
+        os << "  jumps    " << std::setw(12) << jump_count << ", mispredicted " << std::setw(10) << jump_mispredicts
+           << std::setw(8) << Ratio(jump_mispredicts, jump_count) << "%" << std::endl;
+        os << "  returns  " << std::setw(12) << return_count << ", mispredicted " << std::setw(10)
+           << return_mispredicts << std::setw(8) << Ratio(return_mispredicts, return_count) << "%" << std::endl;
+        os << std::defaultfloat;
+    }
+}; // virtual machine namespace
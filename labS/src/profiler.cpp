@@ -0,0 +1,381 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-07 21:03:12
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-07 21:03:12
+ * @Description  : execution profiler
+ */
+#include "profiler.h"
+
+#include <iomanip>
+#include <map>
+
+namespace virtual_machine_nsp {
+    std::vector<profile_loop_tp> profile_observer_tp::Loops() const {
+        std::vector<profile_loop_tp> loops;
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            if (back_edge_count[address] == 0) {
+                continue;
+            }
+            profile_loop_tp loop = {back_edge_target[address], uint16_t(address), back_edge_count[address], 0};
+            for (int inside = loop.header; inside <= loop.end; ++inside) {
+                loop.cycles += pc_count[inside];
+            }
+            loops.push_back(loop);
+        }
+        std::sort(loops.begin(), loops.end(),
+                  [](const profile_loop_tp &a, const profile_loop_tp &b) { return a.cycles > b.cycles; });
+        return loops;
+    }
+
+    static std::string Hex(uint16_t value) {
+        std::ostringstream os;
+        os << 'x' << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << value;
+        return os.str();
+    }
+
+    static double Percent(uint64_t part, uint64_t total) {
+        return total == 0 ? 0.0 : 100.0 * part / total;
+    }
+
+    template <typename Machine>
+    void profile_observer_tp::PrintReport(std::ostream &os, Machine &vm, size_t top) {
+        uint64_t total = 0;
+        std::vector<uint16_t> addresses;
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            total += pc_count[address];
+            if (pc_count[address] != 0) {
+                addresses.push_back(address);
+            }
+        }
+        std::sort(addresses.begin(), addresses.end(),
+                  [this](uint16_t a, uint16_t b) { return pc_count[a] > pc_count[b]; });
+
+        os << std::fixed << std::setprecision(2);
+        os << "profile: " << std::dec << total << " instructions, " << addresses.size() << " addresses" << std::endl;
+        os << "instructions per opcode:" << std::endl;
+        for (int opcode = 0; opcode < 16; ++opcode) {
+            if (kOpcodeName[opcode] != nullptr && opcode_count[opcode] != 0) {
+                os << "  " << std::left << std::setw(5) << kOpcodeName[opcode] << std::right << std::setw(12)
+                   << opcode_count[opcode] << std::setw(8) << Percent(opcode_count[opcode], total) << "%"
+                   << std::endl;
+            }
+        }
+
+        os << "hottest addresses:" << std::endl;
+        for (size_t index = 0; index < addresses.size() && index < top; ++index) {
+            uint16_t address = addresses[index];
+            int16_t word = vm.mem.GetContent(address);
+            const char *name = kOpcodeName[(word >> 12) & 0xF];
+            os << "  " << Hex(address) << "  " << Hex(word) << "  " << std::left << std::setw(5)
+               << (name ? name : "?") << std::right << std::setw(12) << pc_count[address] << std::setw(8)
+               << Percent(pc_count[address], total) << "%" << std::endl;
+        }
+
+        os << "branches (taken / not taken):" << std::endl;
+        std::vector<uint16_t> branches;
+        for (uint16_t address : addresses) {
+            if (((vm.mem.GetContent(address) >> 12) & 0xF) == O_BR && branches.size() < top) {
+                branches.push_back(address);
+            }
+        }
+        for (uint16_t address : branches) {
+            uint64_t taken = taken_count[address];
+            os << "  " << Hex(address) << std::setw(12) << taken << " / " << std::left << std::setw(12)
+               << pc_count[address] - taken << std::right << std::setw(8) << Percent(taken, pc_count[address])
+               << "% taken" << std::endl;
+        }
+
+        os << "hot loops:" << std::endl;
+        std::vector<profile_loop_tp> loops = Loops();
+        for (size_t index = 0; index < loops.size() && index < top; ++index) {
+            const profile_loop_tp &loop = loops[index];
+            os << "  " << Hex(loop.header) << "-" << Hex(loop.end) << std::setw(12) << loop.iterations
+               << " iterations" << std::setw(14) << loop.cycles << " instructions" << std::setw(8)
+               << Percent(loop.cycles, total) << "%" << std::endl;
+        }
+        os << std::defaultfloat;
+    }
+    template void profile_observer_tp::PrintReport(std::ostream &, virtual_machine_tp &, size_t);
+    template void profile_observer_tp::PrintReport(std::ostream &, paged_virtual_machine_tp &, size_t);
+
+    void profile_observer_tp::WriteFoldedStacks(std::ostream &os) {
+        // Outer loops first, so each address sees its loops from the outside in
+        std::vector<profile_loop_tp> loops = Loops();
+        std::sort(loops.begin(), loops.end(), [](const profile_loop_tp &a, const profile_loop_tp &b) {
+            return a.header != b.header ? a.header < b.header : a.end > b.end;
+        });
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            if (pc_count[address] == 0) {
+                continue;
+            }
+            os << "all";
+            for (const profile_loop_tp &loop : loops) {
+                if (loop.header <= address && address <= loop.end) {
+                    os << ";loop_" << Hex(loop.header) << "_" << Hex(loop.end);
+                }
+            }
+            os << ";" << Hex(address) << " " << std::dec << pc_count[address] << "\n";
+        }
+    }
+
+    call_graph_observer_tp::call_graph_observer_tp(uint16_t entry) {
+        std::fill(owner, owner + kVirtualMachineMemorySize, -1);
+        stack.push_back({entry, entry, 0, 0});
+        current = entry;
+        calls[entry] = 1;
+        active[entry] = 1;
+    }
+
+    void call_graph_observer_tp::Charge(uint16_t pc) {
+        if (owner[pc] < 0) {
+            owner[pc] = current;
+            ++pc_count[pc];
+        } else {
+            ++shared_cost[uint32_t(current) << 16 | pc];
+        }
+    }
+
+    void call_graph_observer_tp::Call(uint16_t call_site, uint16_t target) {
+        stack.push_back({target, call_site, uint16_t(call_site + 1), cycle});
+        ++calls[target];
+        ++active[target];
+        current = target;
+    }
+
+    void call_graph_observer_tp::PopFrame() {
+        call_frame_tp frame = stack.back();
+        stack.pop_back();
+        uint64_t elapsed = cycle - frame.entry_cycle;
+        if (--active[frame.function] == 0) {
+            inclusive[frame.function] += elapsed;
+        }
+        uint16_t caller = stack.empty() ? frame.function : stack.back().function;
+        uint64_t key = uint64_t(caller) << 32 | uint64_t(frame.call_site) << 16 | frame.function;
+        call_edge_tp &edge = edges[key];
+        edge.caller = caller;
+        edge.call_site = frame.call_site;
+        edge.callee = frame.function;
+        ++edge.calls;
+        edge.inclusive += elapsed;
+        current = stack.empty() ? -1 : stack.back().function;
+    }
+
+    void call_graph_observer_tp::Return(uint16_t target) {
+        // Only a jump to some frame's return address is a return, the root
+        // frame has none
+        size_t depth = stack.size();
+        while (depth > 1 && stack[depth - 1].return_address != target) {
+            --depth;
+        }
+        if (depth <= 1) {
+            return;
+        }
+        while (stack.size() >= depth) {
+            PopFrame();
+        }
+    }
+
+    void call_graph_observer_tp::Finish() {
+        while (stack.size() > 1) {
+            PopFrame();
+        }
+        // The root frame is not a call, keep it out of the edges
+        call_frame_tp root = stack.back();
+        if (active[root.function] == 1) {
+            inclusive[root.function] += cycle - root.entry_cycle;
+        }
+        active[root.function] = 0;
+        stack.clear();
+        current = -1;
+    }
+
+    // Instructions charged to each subroutine itself, by address
+    static std::map<uint16_t, std::map<uint16_t, uint64_t>> SelfCosts(const call_graph_observer_tp &profile) {
+        std::map<uint16_t, std::map<uint16_t, uint64_t>> costs;
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            if (profile.owner[address] >= 0 && profile.pc_count[address] != 0) {
+                costs[profile.owner[address]][address] += profile.pc_count[address];
+            }
+        }
+        for (const auto &entry : profile.shared_cost) {
+            costs[entry.first >> 16][entry.first & 0xFFFF] += entry.second;
+        }
+        return costs;
+    }
+
+    void call_graph_observer_tp::PrintReport(std::ostream &os, size_t top) const {
+        struct row_tp {
+            uint16_t function;
+            uint64_t self;
+        };
+        std::vector<row_tp> rows;
+        for (const auto &function : SelfCosts(*this)) {
+            uint64_t self = 0;
+            for (const auto &cost : function.second) {
+                self += cost.second;
+            }
+            rows.push_back({function.first, self});
+        }
+        std::sort(rows.begin(), rows.end(), [this](const row_tp &a, const row_tp &b) {
+            return inclusive[a.function] > inclusive[b.function];
+        });
+
+        os << std::fixed << std::setprecision(2);
+        os << "call graph: " << std::dec << cycle << " instructions, " << rows.size() << " subroutines" << std::endl;
+        os << "  function       calls          self              inclusive" << std::endl;
+        for (size_t index = 0; index < rows.size() && index < top; ++index) {
+            const row_tp &row = rows[index];
+            os << "  " << Hex(row.function) << std::setw(12) << calls[row.function] << std::setw(14) << row.self
+               << std::setw(8) << Percent(row.self, cycle) << "%" << std::setw(14) << inclusive[row.function]
+               << std::setw(8) << Percent(inclusive[row.function], cycle) << "%" << std::endl;
+        }
+        os << std::defaultfloat;
+    }
+
+    void call_graph_observer_tp::WriteCallgrind(std::ostream &os, const std::string &program) const {
+        os << "# callgrind format" << std::endl;
+        os << "version: 1" << std::endl;
+        os << "creator: lc3sim" << std::endl;
+        os << "cmd: " << program << std::endl;
+        os << "positions: instr" << std::endl;
+        os << "events: Instructions" << std::endl;
+        os << "summary: " << std::dec << cycle << std::endl << std::endl;
+
+        std::map<uint16_t, std::vector<const call_edge_tp *>> calls_from;
+        for (const auto &entry : edges) {
+            calls_from[entry.second.caller].push_back(&entry.second);
+        }
+        std::map<uint16_t, std::map<uint16_t, uint64_t>> costs = SelfCosts(*this);
+        for (const auto &entry : calls_from) {
+            costs[entry.first];
+        }
+        for (const auto &function : costs) {
+            os << "fl=" << program << std::endl;
+            os << "fn=" << Hex(function.first) << std::endl;
+            for (const auto &cost : function.second) {
+                os << "0x" << std::hex << cost.first << " " << std::dec << cost.second << std::endl;
+            }
+            auto callees = calls_from.find(function.first);
+            if (callees == calls_from.end()) {
+                os << std::endl;
+                continue;
+            }
+            std::vector<const call_edge_tp *> sorted = callees->second;
+            std::sort(sorted.begin(), sorted.end(), [](const call_edge_tp *a, const call_edge_tp *b) {
+                return a->call_site != b->call_site ? a->call_site < b->call_site : a->callee < b->callee;
+            });
+            for (const call_edge_tp *edge : sorted) {
+                os << "cfn=" << Hex(edge->callee) << std::endl;
+                os << "calls=" << std::dec << edge->calls << " 0x" << std::hex << edge->callee << std::endl;
+                os << "0x" << std::hex << edge->call_site << " " << std::dec << edge->inclusive << std::endl;
+            }
+            os << std::endl;
+        }
+    }
+
+    void memory_observer_tp::Sample() {
+        sample_tp sample = {cycle, 0, 0};
+        for (int page = 0; page < kMemoryPageCount; ++page) {
+            uint32_t words = 0;
+            for (int address = page * kMemoryPageSize; address < (page + 1) * kMemoryPageSize; ++address) {
+                words += last_touch[address] != 0 && last_touch[address] + window > cycle;
+            }
+            sample.words += words;
+            sample.pages += words != 0;
+        }
+        working_set.push_back(sample);
+        next_sample += window;
+    }
+
+    void memory_observer_tp::PrintReport(std::ostream &os, size_t top) const {
+        struct page_tp {
+            int page;
+            uint64_t fetches, reads, writes;
+        };
+        std::vector<page_tp> pages;
+        uint64_t reads = 0, writes = 0;
+        for (int page = 0; page < kMemoryPageCount; ++page) {
+            page_tp total = {page, 0, 0, 0};
+            for (int address = page * kMemoryPageSize; address < (page + 1) * kMemoryPageSize; ++address) {
+                total.fetches += fetch_count[address];
+                total.reads += read_count[address];
+                total.writes += write_count[address];
+            }
+            reads += total.reads;
+            writes += total.writes;
+            if (total.fetches + total.reads + total.writes != 0) {
+                pages.push_back(total);
+            }
+        }
+        std::sort(pages.begin(), pages.end(), [](const page_tp &a, const page_tp &b) {
+            return a.fetches + a.reads + a.writes > b.fetches + b.reads + b.writes;
+        });
+
+        os << "memory: " << std::dec << cycle << " fetches, " << reads << " reads, " << writes << " writes, "
+           << pages.size() << " pages touched" << std::endl;
+        os << "  page          fetches         reads        writes" << std::endl;
+        for (size_t index = 0; index < pages.size() && index < top; ++index) {
+            os << "  " << Hex(pages[index].page << 8) << std::setw(15) << pages[index].fetches << std::setw(14)
+               << pages[index].reads << std::setw(14) << pages[index].writes << std::endl;
+        }
+        if (!working_set.empty()) {
+            sample_tp peak = *std::max_element(working_set.begin(), working_set.end(),
+                [](const sample_tp &a, const sample_tp &b) { return a.words < b.words; });
+            uint64_t sum = 0;
+            for (const sample_tp &sample : working_set) {
+                sum += sample.words;
+            }
+            os << "working set over " << window << " instructions: " << sum / working_set.size()
+               << " words on average, peak " << peak.words << " words in " << peak.pages << " pages at cycle "
+               << peak.cycle << std::endl;
+        }
+    }
+
+    bool memory_observer_tp::WriteFiles(const std::string &prefix) const {
+        std::ofstream words(prefix + ".csv");
+        std::ofstream pages(prefix + "-pages.csv");
+        std::ofstream samples(prefix + "-working-set.csv");
+        std::ofstream image(prefix + ".pgm", std::ios::binary);
+        if (!words || !pages || !samples || !image) {
+            return false;
+        }
+
+        words << "address,page,fetches,reads,writes\n";
+        pages << "page,fetches,reads,writes,words_touched\n";
+        uint64_t busiest = 0;
+        for (int page = 0; page < kMemoryPageCount; ++page) {
+            uint64_t fetches = 0, reads = 0, writes = 0, touched = 0;
+            for (int address = page * kMemoryPageSize; address < (page + 1) * kMemoryPageSize; ++address) {
+                uint64_t accesses = fetch_count[address] + read_count[address] + write_count[address];
+                if (accesses == 0) {
+                    continue;
+                }
+                words << Hex(address) << "," << Hex(page << 8) << "," << fetch_count[address] << ","
+                      << read_count[address] << "," << write_count[address] << "\n";
+                fetches += fetch_count[address];
+                reads += read_count[address];
+                writes += write_count[address];
+                ++touched;
+                busiest = std::max(busiest, accesses);
+            }
+            if (touched != 0) {
+                pages << Hex(page << 8) << "," << fetches << "," << reads << "," << writes << "," << touched << "\n";
+            }
+        }
+
+        samples << "cycle,words,pages\n";
+        for (const sample_tp &sample : working_set) {
+            samples << sample.cycle << "," << sample.words << "," << sample.pages << "\n";
+        }
+
+        // Log scale, so words touched once still show up next to hot loops
+        image << "P5\n" << kMemoryPageSize << " " << kMemoryPageCount << "\n255\n";
+        double scale = busiest == 0 ? 0.0 : 255.0 / std::log2(1.0 + busiest);
+        for (int address = 0; address < kVirtualMachineMemorySize; ++address) {
+            uint64_t accesses = fetch_count[address] + read_count[address] + write_count[address];
+            image.put(char(uint8_t(std::lround(std::log2(1.0 + accesses) * scale))));
+        }
+        return true;
+    }
+}; // virtual machine namespace
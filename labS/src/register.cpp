@@ -22,4 +22,18 @@ namespace virtual_machine_nsp {
         os << "\e[1mPC\e[0m = " << std::hex << reg[R_PC] << std::endl;
         return os;
     }
+
+    register_tp ReadRegisterFile(const std::string &regfile) {
+        register_tp reg = {};
+        // Registers are only taken from a file with at least 8 lines
+        std::ifstream input_file(regfile);
+        std::string content((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+        if (std::count(content.begin(), content.end(), '\n') >= 8) {
+            std::istringstream values(content);
+            for (int index = R_R0; index <= R_R7; ++index) {
+                values >> reg[index];
+            }
+        }
+        return reg;
+    }
 } // virtual machine namespace
\ No newline at end of file
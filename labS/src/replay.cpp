@@ -0,0 +1,133 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-20 14:37:05
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-20 14:37:05
+ * @Description  : record and replay of console input and interrupts
+ */
+#include "replay.h"
+
+#include <algorithm>
+
+namespace virtual_machine_nsp {
+    static const char kHexDigits[] = "0123456789abcdef";
+
+    static int HexValue(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        return -1;
+    }
+
+    bool replay_tp::ReplayInput(uint64_t poll, std::string &data, bool &closed) const {
+        auto found = std::lower_bound(inputs.begin(), inputs.end(), poll,
+                                      [](const replay_input_tp &input, uint64_t value) { return input.poll < value; });
+        if (found != inputs.end() && found->poll == poll) {
+            data = found->data;
+            return true;
+        }
+        closed = (has_closed && closed_poll <= poll) || (!recording && found == inputs.end() && !has_closed);
+        return false;
+    }
+
+    void replay_tp::Interrupt(uint64_t cycle, int vector) {
+        if (recording) {
+            if (interrupt_position == interrupts.size()) {
+                interrupts.push_back(replay_interrupt_tp{cycle, vector});
+            }
+            ++interrupt_position;
+            return;
+        }
+        if (diverged) {
+            return;
+        }
+        if (interrupt_position == interrupts.size() || interrupts[interrupt_position].cycle != cycle ||
+            interrupts[interrupt_position].vector != vector) {
+            diverged = true;
+            diverged_cycle = cycle;
+            return;
+        }
+        ++interrupt_position;
+    }
+
+    void replay_tp::Rewind(uint64_t cycle) {
+        // An interrupt logged at cycle was taken before the instruction at cycle
+        interrupt_position = std::upper_bound(interrupts.begin(), interrupts.end(), cycle,
+                                              [](uint64_t value, const replay_interrupt_tp &interrupt) {
+                                                  return value < interrupt.cycle;
+                                              }) -
+                             interrupts.begin();
+    }
+
+    bool replay_tp::Save(const std::string &filename) const {
+        std::ofstream out(filename, std::ios::trunc);
+        out << kReplayHeader << '\n';
+        // Inputs and interrupts merged by cycle, so the log reads in order
+        size_t interrupt = 0;
+        for (const replay_input_tp &input : inputs) {
+            while (interrupt < interrupts.size() && interrupts[interrupt].cycle < input.cycle) {
+                out << "interrupt " << interrupts[interrupt].cycle << ' ' << interrupts[interrupt].vector << '\n';
+                ++interrupt;
+            }
+            out << "input " << input.cycle << ' ' << input.poll << ' ';
+            for (unsigned char c : input.data) {
+                out << kHexDigits[c >> 4] << kHexDigits[c & 15];
+            }
+            out << '\n';
+        }
+        for (; interrupt < interrupts.size(); ++interrupt) {
+            out << "interrupt " << interrupts[interrupt].cycle << ' ' << interrupts[interrupt].vector << '\n';
+        }
+        if (has_closed) {
+            out << "closed " << closed_cycle << ' ' << closed_poll << '\n';
+        }
+        return out.good();
+    }
+
+    bool replay_tp::Load(const std::string &filename, std::string &error) {
+        std::ifstream in(filename);
+        std::string line;
+        if (!std::getline(in, line) || line != kReplayHeader) {
+            error = filename + " is not a replay log";
+            return false;
+        }
+        recording = false;
+        int line_number = 1;
+        while (std::getline(in, line)) {
+            ++line_number;
+            std::istringstream fields(line);
+            std::string kind;
+            fields >> kind;
+            bool good = true;
+            if (kind == "input") {
+                replay_input_tp input;
+                std::string hex;
+                good = bool(fields >> input.cycle >> input.poll >> hex) && hex.size() % 2 == 0;
+                for (size_t index = 0; good && index < hex.size(); index += 2) {
+                    int high = HexValue(hex[index]);
+                    int low = HexValue(hex[index + 1]);
+                    good = high >= 0 && low >= 0;
+                    input.data += char(high << 4 | low);
+                }
+                inputs.push_back(input);
+            } else if (kind == "interrupt") {
+                replay_interrupt_tp interrupt;
+                good = bool(fields >> interrupt.cycle >> interrupt.vector);
+                interrupts.push_back(interrupt);
+            } else if (kind == "closed") {
+                has_closed = bool(fields >> closed_cycle >> closed_poll);
+                good = has_closed;
+            } else {
+                good = kind.empty();
+            }
+            if (!good) {
+                error = filename + ": bad line " + std::to_string(line_number);
+                return false;
+            }
+        }
+        return true;
+    }
+}; // virtual machine namespace
@@ -6,9 +6,24 @@
  * @Description  : file content
  */
 #include "simulator.h"
+#include "observer.h"
+#include "trace.h"
+#include "profiler.h"
+#include "cache.h"
+#include "pipeline.h"
+#include "debugger.h"
+#include "gdb_stub.h"
+#include "history.h"
 #include <cstddef>
 #include <cstdint>
 
+// The single step core, inlined into the loops that run it
+#if defined(__GNUC__)
+#define VM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define VM_ALWAYS_INLINE inline
+#endif
+
 namespace virtual_machine_nsp {
 template <typename T, unsigned B>
 inline T SignExtend(const T x) {//泛型
@@ -22,7 +37,17 @@ inline T SignExtend(const T x) {//泛型
     return x | (full_bits - temp + 1);
 }
 
-void virtual_machine_tp::UpdateCondRegister(int regname) {
+const char *kOpcodeName[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", nullptr, "LEA", "TRAP"
+};
+
+const char *kFusionName[kFusionCount] = {
+    nullptr, "AND+ADD (load immediate)", "ADD+BR (loop back edge)", "LDR+ADD+STR (read-modify-write)"
+};
+
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::UpdateCondRegister(int regname) {
     // Update the condition register
     // TO BE DONE
     if (reg[regname] == 0)
@@ -33,359 +58,825 @@ void virtual_machine_tp::UpdateCondRegister(int regname) {
         reg[R_COND] = 1;
 }
 
-void virtual_machine_tp::VM_ADD(int16_t inst) {
-    int flag = inst & 0b100000;
-    int dr = (inst >> 9) & 0x7;
-    int sr1 = (inst >> 6) & 0x7;
-    if (flag) {
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_ADD(const instruction_tp &inst) {
+    if (inst.flag) {
         // add inst number
-        int16_t imm = SignExtend<int16_t, 5>(inst & 0b11111);
-        reg[dr] = reg[sr1] + imm;
+        reg[inst.dr] = reg[inst.sr1] + inst.imm;
     } else {
         // add register
-        int sr2 = inst & 0x7;
-        reg[dr] = reg[sr1] + reg[sr2];
+        reg[inst.dr] = reg[inst.sr1] + reg[inst.sr2];
     }
     // Update condition register
-    UpdateCondRegister(dr);
+    UpdateCondRegister(inst.dr);
 }
 
-void virtual_machine_tp::VM_AND(int16_t inst) {
-    // TO BE DONE
-        int flag = inst & 0b100000;
-    int dr = (inst >> 9) & 0x7;
-    int sr1 = (inst >> 6) & 0x7;
-    if (flag) {
-        // add inst number
-        int16_t imm = SignExtend<int16_t, 5>(inst & 0b11111);
-        reg[dr] = reg[sr1] & imm;
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_AND(const instruction_tp &inst) {
+    if (inst.flag) {
+        // and inst number
+        reg[inst.dr] = reg[inst.sr1] & inst.imm;
     } else {
-        // add register
-        int sr2 = inst & 0x7;
-        reg[dr] = reg[sr1] & reg[sr2];
+        // and register
+        reg[inst.dr] = reg[inst.sr1] & reg[inst.sr2];
     }
     // Update condition register
-    UpdateCondRegister(dr);
+    UpdateCondRegister(inst.dr);
 }
 
-void virtual_machine_tp::VM_BR(int16_t inst) {
-    int16_t pc_offset = SignExtend<int16_t, 9>(inst & 0x1FF);
-    int16_t cond_flag = (inst >> 9) & 0x7;
-    if (gIsDetailedMode) {
-        std::cout << reg[R_PC] << std::endl;
-        std::cout << pc_offset << std::endl;
-    }
-    if (cond_flag & reg[R_COND]) {
-        reg[R_PC] += pc_offset;
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_BR(const instruction_tp &inst) {
+    if (inst.dr & reg[R_COND]) {
+        reg[R_PC] += inst.imm;
     }
 }
 
-void virtual_machine_tp::VM_JMP(int16_t inst) {
-    // TO BE DONE
-    int sr=(inst>>6)&0x7;
-    if (gIsDetailedMode){
-        std::cout<<reg[R_PC]<<std::endl;
-        std::cout<<reg[sr]<<std::endl;
-    }
-    reg[R_PC]=reg[sr];
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_JMP(const instruction_tp &inst) {
+    reg[R_PC] = reg[inst.sr1];
 }
 
-void virtual_machine_tp::VM_JSR(int16_t inst) {
-    // TO BE DONE
-    int flag=inst & 0x800;
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_JSR(const instruction_tp &inst) {
     int16_t temp = reg[R_PC];
-    if (flag){
-        int16_t offset=SignExtend<int16_t, 11>(inst&0x7ff);
-        if (gIsDetailedMode)
-            {
-                std::cout << reg[R_PC] << std::endl;
-                std::cout << offset << std::endl;
-            }
-        reg[R_PC]+=offset;
-        
-    }
-     else
-        {
-            int sr = (inst >> 6) & 0x7;
-            if (gIsDetailedMode)
-            {
-                std::cout << reg[R_PC] << std::endl;
-                std::cout << reg[sr] << std::endl;
-            }
-            reg[R_PC] = reg[sr];
-        }
-    reg[7]=temp;
+    if (inst.flag) {
+        reg[R_PC] += inst.imm;
+    } else {
+        reg[R_PC] = reg[inst.sr1];
+    }
+    reg[R_R7] = temp;
 }
 
-void virtual_machine_tp::VM_LD(int16_t inst) {
-    int16_t dr = (inst >> 9) & 0x7;
-    int16_t pc_offset = SignExtend<int16_t, 9>(inst & 0x1FF);
-    reg[dr] = mem[reg[R_PC] + pc_offset];
-    UpdateCondRegister(dr);
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_LD(const instruction_tp &inst) {
+    reg[inst.dr] = LoadMemory(reg[R_PC] + inst.imm);
+    UpdateCondRegister(inst.dr);
 }
 
-void virtual_machine_tp::VM_LDI(int16_t inst) {
-    // TO BE DONE
-    int16_t dr = (inst>>9)&0x7;
-    int16_t offset=SignExtend<int16_t, 9>(inst & 0x1FF);
-    reg[dr]=mem[mem[reg[R_PC]+offset]];
-    UpdateCondRegister(dr);
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_LDI(const instruction_tp &inst) {
+    reg[inst.dr] = LoadMemory(LoadMemory(reg[R_PC] + inst.imm));
+    UpdateCondRegister(inst.dr);
 }
 
-void virtual_machine_tp::VM_LDR(int16_t inst) {
-    // TO BE DONE
-    int16_t dr=(inst >> 9) & 0x7;
-    int16_t sr=(inst >> 6) & 0x7;
-    int16_t offset=SignExtend<int16_t, 6>(inst & 0x3F);
-    reg[dr]=mem[reg[sr]+offset];
-    UpdateCondRegister(dr);
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_LDR(const instruction_tp &inst) {
+    reg[inst.dr] = LoadMemory(reg[inst.sr1] + inst.imm);
+    UpdateCondRegister(inst.dr);
 }
 
-void virtual_machine_tp::VM_LEA(int16_t inst) {
-    // TO BE DONE
-    int16_t dr=(inst>>9)&0x7;
-    int16_t pc_offset=SignExtend<int16_t, 9>(inst & 0x1FF);
-    reg[dr]=reg[R_PC]+pc_offset;
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_LEA(const instruction_tp &inst) {
+    reg[inst.dr] = reg[R_PC] + inst.imm;
 }
 
-void virtual_machine_tp::VM_NOT(int16_t inst) {
-    // TO BE DONE
-    int16_t dr=(inst >> 9)&0x7;
-    int16_t sr=(inst >> 6)&0x7;
-    reg[dr]=~reg[sr];
-    UpdateCondRegister(dr);
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_NOT(const instruction_tp &inst) {
+    reg[inst.dr] = ~reg[inst.sr1];
+    UpdateCondRegister(inst.dr);
 }
 
-void virtual_machine_tp::VM_RTI(int16_t inst) {
-    ; // PASS
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::VM_RTI(const instruction_tp &inst) {
+    if (inst.opcode != O_RTI) {
+        // Reserved opcode
+        return;
+    }
+    if (user_mode) {
+        // Privilege mode violation, ignored without a handler
+        if (mem.GetContent(kInterruptTable + kPrivilegeViolation) != 0) {
+            TakeInterrupt(kPrivilegeViolation, priority);
+        }
+        return;
+    }
+    reg[R_PC] = mem.GetContent(uint16_t(reg[R_R6]));
+    int16_t psr = mem.GetContent(uint16_t(reg[R_R6] + 1));
+    reg[R_R6] += 2;
+    SetProcessorStatus(psr);
+    // A request may have been held back by the old priority
+    next_event_cycle = 0;
+}
 
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_ST(const instruction_tp &inst) {
+    StoreMemory(reg[R_PC] + inst.imm, reg[inst.dr]);
 }
 
-void virtual_machine_tp::VM_ST(int16_t inst) {
-    // TO BE DONE
-    int16_t sr =(inst>>9)&0x7;
-    int16_t offset=SignExtend<int16_t,9>(inst&0x1ff);
-    mem[reg[R_PC]+offset]=reg[sr];
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_STI(const instruction_tp &inst) {
+    StoreMemory(LoadMemory(reg[R_PC] + inst.imm), reg[inst.dr]);
 }
 
-void virtual_machine_tp::VM_STI(int16_t inst) {
-    // TO BE DONE
-    int16_t sr=(inst>>9)&0x7;
-    int16_t dr =(inst>>6)&0x07;
-    int16_t offset=SignExtend<int16_t,6>(inst&0x3f);
-    mem[reg[dr]+offset]=reg[sr];
+template <typename Memory>
+inline void basic_virtual_machine_tp<Memory>::VM_STR(const instruction_tp &inst) {
+    StoreMemory(reg[inst.sr1] + inst.imm, reg[inst.dr]);
 }
 
-void virtual_machine_tp::VM_STR(int16_t inst) {
-    // TO BE DONE
-    int sr=(inst>>9)&0x7;
-    int dr=(inst>>6)&0x7;
-    int16_t offset=SignExtend<int16_t, 6>(inst & 0x3F);
-    mem[reg[dr]+offset]=reg[sr];
-}
-
-void virtual_machine_tp::VM_TRAP(int16_t inst) {
-    int trapnum = inst & 0xFF;
-    // if (trapnum == 0x25)
-    //     exit(0);
-    if (trapnum==0x25){
-        reg[R_PC]=0;
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::VM_TRAP(const instruction_tp &inst) {
+    int trapnum = inst.imm;
+    reg[R_R7] = reg[R_PC];
+    if (trap_mode == M_NATIVE && NativeTrap(trapnum)) {
         return;
     }
-    // TODO: build trap program
-    if (trapnum==0x20){//getc
-        char temp;
-        printf("get a char");
-        std::cin>>temp;
-        reg[0]=(int16_t)temp;
-    }
-    if (trapnum==0x21){//getc
-        printf("number in r0 represents");
-        std::cout<<(char)reg[0];
-    }
-    if (trapnum==0x22){
-        printf("string stored in R0 is:");
-        int16_t add=reg[0];
-        while (mem[add]!=0){
-            if (mem[add]>127){
-                printf("error\n");
-                break;
-            }
-            std::cout<<(char)mem[add++];
-        }
-    }
-    if (trapnum==0x23){
-        char temp;
-        printf("get a char");
-        std::cin>>temp;
-        reg[0]=(int16_t)temp;
-        std::cout<<temp;
+    // Dispatch through the trap vector table, an empty entry does nothing
+    int16_t routine = mem.GetContent(trapnum);
+    if (routine != 0) {
+        reg[R_PC] = routine;
     }
 }
 
-virtual_machine_tp::virtual_machine_tp(const int16_t address, const std::string &memfile, const std::string &regfile) {
-    // Read memory
-    if (memfile != ""){
-        mem.ReadMemoryFromFile(memfile);
+template <typename Memory>
+bool basic_virtual_machine_tp<Memory>::ReadTrapInput(int &c) {
+    c = console.GetChar();
+    while (c == kInputPending) {
+        if (yield_on_input) {
+            // Run the trap again once input has arrived
+            reg[R_PC]--;
+            input_wait = true;
+            next_event_cycle = 0;
+            return false;
+        }
+        console.WaitForInput();
+        c = console.GetChar();
     }
-    
-    // Read registers
-    std::ifstream input_file;
-    input_file.open(regfile);
-    if (input_file.is_open()) {
-        int line_count = std::count(std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>(), '\n');
-        input_file.close();
-        input_file.open(regfile);
-        if (line_count >= 8) {
-            for (int index = R_R0; index <= R_R7; ++index) {
-                input_file >> reg[index];
+    return true;
+}
+
+// Native versions of the standard service routines. They behave like the
+// routines of the LC-3 OS but skip the polling loops. Returns false for
+// vectors without a native version.
+template <typename Memory>
+bool basic_virtual_machine_tp<Memory>::NativeTrap(int vector) {
+    switch (vector) {
+        case 0x20: { // GETC
+            int c;
+            if (ReadTrapInput(c)) {
+                reg[R_R0] = c < 0 ? 0 : c;
             }
-        } else {
-            for (int index = R_R0; index <= R_R7; ++index) {
-                reg[index] = 0;
+            return true;
+        }
+        case 0x21: // OUT
+            console.Put(char(reg[R_R0]));
+            return true;
+        case 0x22: { // PUTS
+            // Find the end first, then hand the whole string over at once
+            std::string text;
+            uint16_t address = reg[R_R0];
+            int16_t word;
+            while (text.size() < kMaxTrapString && (word = mem.GetContent(address++)) != 0) {
+                text += char(word);
             }
+            console.Write(text.data(), text.size());
+            return true;
         }
-        input_file.close();
-    } else {
-        for (int index = R_R0; index <= R_R7; ++index) {
-            reg[index] = 0;
+        case 0x23: { // IN
+            if (!prompt_shown) {
+                console.Write("\nInput a character> ");
+            }
+            int c;
+            prompt_shown = !ReadTrapInput(c);
+            if (!prompt_shown) {
+                reg[R_R0] = c < 0 ? 0 : c;
+                if (c >= 0) {
+                    console.Put(char(c));
+                }
+            }
+            return true;
+        }
+        case 0x24: { // PUTSP, two characters per word, low byte first
+            std::string text;
+            uint16_t address = reg[R_R0];
+            int16_t word;
+            while (text.size() < 2 * kMaxTrapString && (word = mem.GetContent(address++)) != 0) {
+                text += char(word & 0xFF);
+                if ((word >> 8 & 0xFF) == 0) {
+                    break;
+                }
+                text += char(word >> 8 & 0xFF);
+            }
+            console.Write(text.data(), text.size());
+            return true;
         }
+        case 0x25: // HALT
+            console.Flush();
+            reg[R_PC] = 0;
+            return true;
+        default:
+            return false;
     }
-
-    // Set address
-    reg[R_PC] = address;
-    reg[R_COND] = 0;
 }
 
-void virtual_machine_tp::SetReg(const register_tp &new_reg) {
-    reg = new_reg;
-}
+template <typename Memory>
+instruction_tp basic_virtual_machine_tp<Memory>::Decode(int16_t inst) {
+    instruction_tp result;
+    result.inst = inst;
+    result.opcode = (inst >> 12) & 0xF;
+    result.dr = (inst >> 9) & 0x7;
+    result.sr1 = (inst >> 6) & 0x7;
+    result.sr2 = inst & 0x7;
+    result.flag = false;
+    result.imm = 0;
+    result.dispatch = result.opcode;
+    result.length = 1;
+    result.hits = 0;
 
-int16_t virtual_machine_tp::NextStep() {
-    int16_t current_pc = reg[R_PC];
-    reg[R_PC]++;
-    int16_t current_instruct = mem[current_pc];
-    int opcode = (current_instruct >> 12) & 15;
-    
-    switch (opcode) {
+    switch (result.opcode) {
         case O_ADD:
-        if (gIsDetailedMode) {
-            std::cout << "ADD" << std::endl;
-        }
-        VM_ADD(current_instruct);
-        break;
         case O_AND:
-        // TO BE DONE
-        if (gIsDetailedMode){
-            std::cout << "AND" << std::endl;
-        }
-        VM_AND(current_instruct);
+        result.flag = inst & 0b100000;
+        result.imm = SignExtend<int16_t, 5>(inst & 0x1F);
         break;
         case O_BR:
-            if (gIsDetailedMode)
-            {
-                std::cout << "BR" << std::endl;
-            }
-            VM_BR(current_instruct);
+        case O_LD:
+        case O_LDI:
+        case O_LEA:
+        case O_ST:
+        case O_STI:
+        result.imm = SignExtend<int16_t, 9>(inst & 0x1FF);
         break;
-        // TO BE DONE
-        case O_JMP:
-         if (gIsDetailedMode){
-            std::cout << "JMP" << std::endl;
-        }
-        VM_JMP(current_instruct);
+        case O_LDR:
+        case O_STR:
+        result.imm = SignExtend<int16_t, 6>(inst & 0x3F);
         break;
-        // TO BE DONE
         case O_JSR:
-        if (gIsDetailedMode){
-            std::cout << "JSR" << std::endl;
-        }
-        VM_JSR(current_instruct);
+        result.flag = inst & 0x800;
+        result.imm = SignExtend<int16_t, 11>(inst & 0x7FF);
         break;
-        // TO BE DONE
-        case O_LD:
-        if (gIsDetailedMode){
-            std::cout << "LD" << std::endl;
-        }
-        VM_LD(current_instruct);
-        // TO BE DONE
+        case O_TRAP:
+        result.imm = inst & 0xFF;
         break;
-        case O_LDI:
-        if (gIsDetailedMode){
-            std::cout << "LDI" << std::endl;
-        }
-        VM_LDI(current_instruct);
-        // TO BE DONE
+        default:
         break;
-        case O_LDR:
-        if (gIsDetailedMode){
-            std::cout << "LDr" << std::endl;
+    }
+    return result;
+}
+
+template <typename Memory>
+const instruction_tp &basic_virtual_machine_tp<Memory>::FetchDecoded(uint16_t address) {
+    PrepareDecode();
+    instruction_tp &entry = DecodeSlot(address);
+    if (entry.length == 0) {
+        entry = Decode(mem.GetContent(address));
+    }
+    return entry;
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::InvalidateDecoded(uint16_t address) {
+    instruction_tp *page = DecodePage(address);
+    if (page == nullptr) {
+        return;
+    }
+    int offset = PageOffset(address);
+    page[offset].length = 0;
+    // Split superinstructions that cover this word, they never cross a page
+    for (int distance = 1; distance < 3 && distance <= offset; ++distance) {
+        instruction_tp &entry = page[offset - distance];
+        if (entry.length > distance) {
+            entry.dispatch = entry.opcode;
+            entry.length = 1;
         }
-        VM_LDR(current_instruct);
-        // TO BE DONE
-        break;
-        case O_LEA:
-        if (gIsDetailedMode){
-            std::cout << "LEA" << std::endl;
+    }
+}
+
+// Try to start a superinstruction at address, returns the fusion kind
+template <typename Memory>
+int basic_virtual_machine_tp<Memory>::FuseAt(uint16_t address) {
+    // Superinstructions read the following cache entries, so they must stay in one page
+    if (PageOffset(address) > kMemoryPageSize - 2) {
+        return F_NONE;
+    }
+    FetchDecoded(address);
+    instruction_tp &first = DecodeSlot(address);
+    if (first.length > 1) {
+        return F_NONE;
+    }
+    const instruction_tp &second = FetchDecoded(address + 1);
+    int fusion = F_NONE;
+    if (first.opcode == O_AND && first.flag && first.imm == 0 && first.dr == first.sr1 &&
+        second.opcode == O_ADD && second.flag && second.dr == first.dr && second.sr1 == first.dr) {
+        // The condition code set by AND is dead
+        fusion = F_LOAD_IMM;
+    } else if (first.opcode == O_ADD && second.opcode == O_BR && second.inst != 0) {
+        fusion = F_ADD_BR;
+    } else if (first.opcode == O_LDR && first.dr != first.sr1 && second.opcode == O_ADD &&
+               second.dr == first.dr && PageOffset(address) <= kMemoryPageSize - 3) {
+        const instruction_tp &third = FetchDecoded(address + 2);
+        if (third.opcode == O_STR && third.dr == first.dr && third.sr1 == first.sr1 && third.imm == first.imm) {
+            // The condition code set by LDR is dead
+            fusion = F_LDR_ADD_STR;
         }
-        VM_LEA(current_instruct);
-        // TO BE DONE
-        break;
-        case O_NOT:
-        if (gIsDetailedMode){
-            std::cout << "not" << std::endl;
+    }
+    if (fusion != F_NONE) {
+        first.dispatch = 16 + fusion - 1;
+        first.length = fusion == F_LDR_ADD_STR ? 3 : 2;
+        ++fusion_sites[fusion];
+    }
+    return fusion;
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::FuseRange(uint16_t begin, uint16_t end) {
+    for (uint16_t address = begin; address != end; ++address) {
+        FuseAt(address);
+    }
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::PrintFusionReport(std::ostream &os) const {
+    os << "superinstructions:" << std::endl;
+    for (int fusion = F_NONE + 1; fusion < kFusionCount; ++fusion) {
+        os << "  " << kFusionName[fusion] << ": " << std::dec << fusion_sites[fusion] << " sites, "
+           << fusion_count[fusion] << " executions" << std::endl;
+    }
+}
+
+template <typename Memory>
+int16_t basic_virtual_machine_tp<Memory>::ReadDevice(uint16_t address) {
+    switch (address) {
+        case kKeyboardStatus:
+        return (console.InputReady() ? kDeviceReady : 0) | (keyboard_interrupt_enable ? kInterruptEnable : 0);
+        case kKeyboardData:   return console.ReadData();
+        case kDisplayStatus:  return kDeviceReady;
+        case kTimerStatus: {
+            int16_t status = (timer.expired ? kDeviceReady : 0) | (timer.interrupt_enable ? kInterruptEnable : 0);
+            timer.expired = false;
+            return status;
         }
-        VM_NOT(current_instruct);
-        // TO BE DONE
+        case kTimerInterval:    return timer.interval;
+        case kProcessorStatus:  return ProcessorStatus();
+        default:                return mem.GetContent(address);
+    }
+}
+
+template <typename Memory>
+bool basic_virtual_machine_tp<Memory>::WriteDevice(uint16_t address, int16_t value) {
+    switch (address) {
+        case kDisplayData:
+        console.Put(char(value));
+        return true;
+        case kKeyboardStatus:
+        keyboard_interrupt_enable = value & kInterruptEnable;
         break;
-        case O_RTI:
-        if (gIsDetailedMode){
-            std::cout << "RTI" << std::endl;
-        }
-        VM_RTI(current_instruct);
-        // TO BE DONE
+        case kTimerStatus:
+        timer.interrupt_enable = value & kInterruptEnable;
         break;
-        case O_ST:
-        if (gIsDetailedMode){
-            std::cout << "ST" << std::endl;
-        }
-        VM_ST(current_instruct);
-        // TO BE DONE
+        case kTimerInterval:
+        timer.interval = value;
+        timer.reprogrammed = true;
         break;
-        case O_STI:
-        if (gIsDetailedMode){
-            std::cout << "STI" << std::endl;
-        }
-        VM_STI(current_instruct);
-        // TO BE DONE
+        case kProcessorStatus:
+        SetProcessorStatus(value);
         break;
-        case O_STR:
-        // TO BE DONE
-        if (gIsDetailedMode){
-            std::cout << "STR" << std::endl;
+        case kMachineControl:
+        mem[address] = value;
+        if (value >= 0) {
+            // The clock enable bit was cleared
+            reg[R_PC] = 0;
+            halted = true;
         }
-        VM_STR(current_instruct);
         break;
-        case O_TRAP:
-        if (gIsDetailedMode) {
-            std::cout << "TRAP" << std::endl;
+        default:
+        return false;
+    }
+    // Let the engine reach a service point before the next instruction
+    next_event_cycle = 0;
+    return true;
+}
+
+template <typename Memory>
+int16_t basic_virtual_machine_tp<Memory>::ProcessorStatus() const {
+    return int16_t((user_mode ? 0x8000 : 0) | (priority << 8) | (reg[R_COND] & 7));
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::SetProcessorStatus(int16_t psr) {
+    bool to_user = psr < 0;
+    if (to_user && !user_mode) {
+        saved_ssp = reg[R_R6];
+        reg[R_R6] = saved_usp;
+    } else if (!to_user && user_mode) {
+        saved_usp = reg[R_R6];
+        reg[R_R6] = saved_ssp;
+    }
+    user_mode = to_user;
+    priority = (psr >> 8) & 7;
+    reg[R_COND] = psr & 7;
+}
+
+// Push PSR and PC on the supervisor stack and enter the handler of vector
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::TakeInterrupt(int vector, int new_priority) {
+    int16_t psr = ProcessorStatus();
+    if (user_mode) {
+        saved_usp = reg[R_R6];
+        reg[R_R6] = saved_ssp;
+        user_mode = false;
+    }
+    reg[R_R6] -= 2;
+    StoreMemory(reg[R_R6] + 1, psr);
+    StoreMemory(reg[R_R6], reg[R_PC]);
+    priority = new_priority;
+    reg[R_PC] = mem.GetContent(kInterruptTable + vector);
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::ServiceEvents() {
+    // Device writes since the last service point
+    if (timer.reprogrammed) {
+        timer.reprogrammed = false;
+        ++timer.generation;
+        if (timer.interval != 0) {
+            events.Post(cycle + timer.interval, E_TIMER, timer.generation);
         }
-        if ((current_instruct & 0xFF) == 0x25) {
-            reg[R_PC] = 0;
+    }
+    if (keyboard_interrupt_enable && !keyboard_polling) {
+        keyboard_polling = true;
+        events.Post(cycle, E_KEYBOARD);
+    }
+
+    event_tp event;
+    while (events.PopDue(cycle, event)) {
+        if (event.kind == E_TIMER) {
+            if (event.generation != timer.generation) {
+                continue;
+            }
+            timer.expired = true;
+            if (timer.interrupt_enable) {
+                interrupts.Raise(kTimerVector, kTimerPriority);
+            }
+            events.Post(event.cycle + timer.interval, E_TIMER, timer.generation);
+        } else if (event.kind == E_KEYBOARD) {
+            if (!keyboard_interrupt_enable) {
+                keyboard_polling = false;
+                continue;
+            }
+            if (console.InputReady()) {
+                interrupts.Raise(kKeyboardVector, kKeyboardPriority);
+            }
+            events.Post(cycle + kKeyboardPollInterval, E_KEYBOARD);
+        }
+    }
+
+    // Take the highest request above the processor priority. Requests
+    // without a handler in the vector table stay pending, as a privilege
+    // violation without one is ignored.
+    for (int level = 7; !halted && level > priority; --level) {
+        int vector = interrupts.Pending(level);
+        if (vector < 0 || mem.GetContent(kInterruptTable + vector) == 0) {
+            continue;
+        }
+        interrupts.Acknowledge(level);
+        if (replay != nullptr) {
+            replay->Interrupt(cycle, vector);
         }
-        VM_TRAP(current_instruct);
+        TakeInterrupt(vector, level);
         break;
-        default:
-        VM_RTI(current_instruct);
-        break;       
     }
+    next_event_cycle = events.NextCycle();
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::StoreMemory(uint16_t address, int16_t value) {
+    if (address >= kDeviceBase && WriteDevice(address, value)) {
+        return;
+    }
+    mem[address] = value;
+    // Self-modifying code: drop the stale decode of this word
+    InvalidateDecoded(address);
+}
 
-    if (current_instruct == 0) {
+template <typename Memory>
+basic_virtual_machine_tp<Memory>::basic_virtual_machine_tp(const int16_t address, const std::string &memfile, const std::string &regfile) {
+    // Read memory
+    if (memfile != ""){
+        image_begin = address;
+        image_size = mem.ReadMemoryFromFile(memfile, address);
+    }
+    
+    reg = ReadRegisterFile(regfile);
+
+    // Set address
+    reg[R_PC] = address;
+    reg[R_COND] = 0;
+}
+
+template <typename Memory>
+basic_virtual_machine_tp<Memory>::basic_virtual_machine_tp(const int16_t address,
+                                                           const std::shared_ptr<const memory_image_tp> &image,
+                                                           const std::string &regfile) {
+    mem.LoadImage(image);
+    image_begin = image->image_begin;
+    image_size = image->image_size;
+    reg = ReadRegisterFile(regfile);
+    reg[R_PC] = address;
+    reg[R_COND] = 0;
+}
+
+template <typename Memory>
+bool basic_virtual_machine_tp<Memory>::LoadOperatingSystem(const std::string &filename) {
+    uint16_t origin = 0;
+    std::vector<int16_t> words;
+    if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".obj") == 0) {
+        words = ReadObjectFile(filename, origin);
+    } else {
+        words = ReadWordsFromFile(filename);
+    }
+    if (words.empty()) {
+        return false;
+    }
+    for (size_t index = 0; index < words.size(); ++index) {
+        uint16_t address = origin + index;
+        mem[address] = words[index];
+        InvalidateDecoded(address);
+    }
+    // Start with the clock running so the HALT routine can stop it
+    if (mem.GetContent(kMachineControl) == 0) {
+        mem[kMachineControl] = kDeviceReady;
+    }
+    return true;
+}
+
+template <typename Memory>
+void basic_virtual_machine_tp<Memory>::SetReg(const register_tp &new_reg) {
+    reg = new_reg;
+}
+
+template <typename Memory>
+template <typename Observer>
+VM_ALWAYS_INLINE int16_t basic_virtual_machine_tp<Memory>::NextStep(Observer &observer) {
+    int16_t current_pc = reg[R_PC];
+    reg[R_PC]++;
+    instruction_tp &current = DecodeSlot(current_pc);
+    if (current.length == 0) {
+        current = Decode(mem.GetContent(current_pc));
+    }
+
+    observer.BeforeExecute(*this, current_pc, current);
+    if (Observer::kObservesInstructions && restart_step) {
+        restart_step = false;
+        return reg[R_PC];
+    }
+    // Dispatch on the predecoded opcode right here, no call per instruction
+    switch (current.opcode) {
+        case O_ADD: VM_ADD(current); break;
+        case O_AND: VM_AND(current); break;
+        case O_BR:  VM_BR(current);  break;
+        case O_JMP: VM_JMP(current); break;
+        case O_JSR: VM_JSR(current); break;
+        case O_LD:  VM_LD(current);  break;
+        case O_LDI: VM_LDI(current); break;
+        case O_LDR: VM_LDR(current); break;
+        case O_LEA: VM_LEA(current); break;
+        case O_NOT: VM_NOT(current); break;
+        case O_ST:  VM_ST(current);  break;
+        case O_STI: VM_STI(current); break;
+        case O_STR: VM_STR(current); break;
+        case O_TRAP: VM_TRAP(current); break;
+        default:    VM_RTI(current); break;
+    }
+    observer.AfterExecute(*this, current_pc, current);
+    ++cycle;
+
+    if (current.inst == 0 || reg[R_PC] == 0) {
         // END
         // TODO: add more detailed judge information
+        halted = true;
         return 0;
     }
+    if (cycle >= next_event_cycle) {
+        if (input_wait) {
+            // The stalled trap did not run
+            --cycle;
+            return reg[R_PC];
+        }
+        ServiceEvents();
+        if (halted) {
+            return 0;
+        }
+    }
     return reg[R_PC];
 }
 
-} // namespace virtual_machine_nsp
\ No newline at end of file
+// Execute instructions one NextStep at a time until cycle reaches end, the
+// program halts or a trap stalls for input, which leaves the service point
+// pending. NextStep is inlined into this loop, no call per instruction.
+template <typename Memory>
+template <typename Observer>
+void basic_virtual_machine_tp<Memory>::RunSwitch(uint64_t end, Observer &observer) {
+    PrepareDecode();
+    while (cycle < end && NextStep(observer) != 0 && cycle < next_event_cycle) {
+    }
+}
+
+template <typename Memory>
+int16_t basic_virtual_machine_tp<Memory>::NextStep() {
+    null_observer_tp observer;
+    PrepareDecode();
+    return NextStep(observer);
+}
+
+// Execute up to max_steps instructions, stopping at every due device event
+// to service it. The threaded core runs until the next event without any
+// further check.
+template <typename Memory>
+template <typename Observer>
+uint64_t basic_virtual_machine_tp<Memory>::Run(uint64_t max_steps, Observer &observer) {
+    uint64_t steps = 0;
+    while (steps < max_steps && !halted && !input_wait) {
+        if (cycle >= next_event_cycle) {
+            ServiceEvents();
+            continue;
+        }
+        steps += RunThreaded(std::min(max_steps - steps, next_event_cycle - cycle), observer);
+    }
+    return steps;
+}
+
+// Execute up to max_steps instructions without returning to the caller in
+// between. Every handler ends with its own indirect jump to the next one,
+// so the branch predictor sees one dispatch site per opcode instead of the
+// single shared one of the NextStep switch. Returns the executed steps.
+// Superinstructions are only used when the observer does not need to see
+// every single instruction.
+template <typename Memory>
+template <typename Observer>
+uint64_t basic_virtual_machine_tp<Memory>::RunThreaded(uint64_t max_steps, Observer &observer) {
+    constexpr bool kFuse = !Observer::kObservesInstructions;
+    uint64_t steps = 0;
+    if (halted) {
+        return steps;
+    }
+    PrepareDecode();
+#if defined(__GNUC__)
+    static void *const kDispatch[16 + kFusionCount - 1] = {
+        &&op_br,  &&op_add, &&op_ld,  &&op_st,  &&op_jsr, &&op_and, &&op_ldr,  &&op_str,
+        &&op_rti, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_rti, &&op_lea, &&op_trap,
+        &&op_load_imm, &&op_add_br, &&op_ldr_add_str
+    };
+    instruction_tp *current;
+    uint16_t current_pc;
+
+#define VM_RETURN()                                                \
+    do {                                                           \
+        cycle += steps;                                            \
+        return steps;                                              \
+    } while (0)
+#define VM_DISPATCH()                                              \
+    do {                                                           \
+        if (steps == max_steps) {                                  \
+            VM_RETURN();                                           \
+        }                                                          \
+        current_pc = reg[R_PC]++;                                  \
+        current = &DecodeSlot(current_pc);                         \
+        if (current->length == 0) {                                \
+            *current = Decode(mem.GetContent(current_pc));         \
+        }                                                          \
+        observer.BeforeExecute(*this, current_pc, *current);       \
+        if (!kFuse && restart_step) {                              \
+            restart_step = false;                                  \
+            VM_RETURN();                                           \
+        }                                                          \
+        if (!kFuse || steps + current->length > max_steps) {       \
+            ++steps;                                               \
+            goto *kDispatch[current->opcode];                      \
+        }                                                          \
+        steps += current->length;                                  \
+        goto *kDispatch[current->dispatch];                        \
+    } while (0)
+#define VM_NEXT()                                                  \
+    do {                                                           \
+        observer.AfterExecute(*this, current_pc, *current);        \
+        if (reg[R_PC] == 0) {                                      \
+            halted = true;                                         \
+            VM_RETURN();                                           \
+        }                                                          \
+        VM_DISPATCH();                                             \
+    } while (0)
+// After stores and RTI: a device write may have asked for a service point
+#define VM_NEXT_CHECKED()                                          \
+    do {                                                           \
+        if (next_event_cycle <= cycle) {                           \
+            observer.AfterExecute(*this, current_pc, *current);    \
+            halted = halted || reg[R_PC] == 0;                     \
+            VM_RETURN();                                           \
+        }                                                          \
+        VM_NEXT();                                                 \
+    } while (0)
+
+    VM_DISPATCH();
+
+    op_add:  VM_ADD(*current);  VM_NEXT();
+    op_and:  VM_AND(*current);  VM_NEXT();
+    op_br:
+    if (current->inst == 0) {
+        observer.AfterExecute(*this, current_pc, *current);
+        halted = true;
+        VM_RETURN();
+    }
+    VM_BR(*current);
+    if (kFuse && current->imm < 0 && (current->dr & reg[R_COND]) && current->hits++ == kFusionHotThreshold) {
+        // Hot loop: fuse its body as it is now
+        uint16_t loop_end = reg[R_PC] - current->imm;
+        FuseRange(reg[R_PC], loop_end);
+    }
+    VM_NEXT();
+    op_jmp:  VM_JMP(*current);  VM_NEXT();
+    op_jsr:  VM_JSR(*current);  VM_NEXT();
+    op_ld:   VM_LD(*current);   VM_NEXT();
+    op_ldi:  VM_LDI(*current);  VM_NEXT();
+    op_ldr:  VM_LDR(*current);  VM_NEXT();
+    op_lea:  VM_LEA(*current);  VM_NEXT();
+    op_not:  VM_NOT(*current);  VM_NEXT();
+    op_rti:  VM_RTI(*current);  VM_NEXT_CHECKED();
+    op_st:   VM_ST(*current);   VM_NEXT_CHECKED();
+    op_sti:  VM_STI(*current);  VM_NEXT_CHECKED();
+    op_str:  VM_STR(*current);  VM_NEXT_CHECKED();
+    op_trap:
+    VM_TRAP(*current);
+    if (input_wait) {
+        // The stalled trap did not run
+        --steps;
+        VM_RETURN();
+    }
+    VM_NEXT_CHECKED();
+
+    // Superinstructions, current points at the first of consecutive cache entries
+    op_load_imm:
+    ++fusion_count[F_LOAD_IMM];
+    reg[current[1].dr] = current[1].imm;
+    UpdateCondRegister(current[1].dr);
+    reg[R_PC]++;
+    VM_NEXT();
+    op_add_br:
+    ++fusion_count[F_ADD_BR];
+    VM_ADD(current[0]);
+    reg[R_PC]++;
+    VM_BR(current[1]);
+    VM_NEXT();
+    op_ldr_add_str:
+    ++fusion_count[F_LDR_ADD_STR];
+    reg[current[0].dr] = LoadMemory(reg[current[0].sr1] + current[0].imm);
+    VM_ADD(current[1]);
+    reg[R_PC] += 2;
+    StoreMemory(reg[current[0].sr1] + current[0].imm, reg[current[0].dr]);
+    VM_NEXT_CHECKED();
+
+#undef VM_NEXT_CHECKED
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_RETURN
+#else
+    // No computed goto: fall back to the single step engine, which keeps cycle itself
+    while (steps < max_steps && !halted) {
+        NextStep(observer);
+        if (input_wait) {
+            break;
+        }
+        ++steps;
+    }
+    return steps;
+#endif
+}
+
+template <typename Memory>
+uint64_t basic_virtual_machine_tp<Memory>::Run(uint64_t max_steps) {
+    null_observer_tp observer;
+    return Run(max_steps, observer);
+}
+
+template class basic_virtual_machine_tp<memory_tp>;
+template class basic_virtual_machine_tp<paged_memory_tp>;
+
+// One instantiation of the execution core per observer policy
+#define VM_INSTANTIATE_OBSERVER(Machine, Observer)                                      \
+    template int16_t Machine::NextStep<Observer>(Observer &);                          \
+    template void Machine::RunSwitch<Observer>(uint64_t, Observer &);                  \
+    template uint64_t Machine::Run<Observer>(uint64_t, Observer &);
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, null_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, detail_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, counting_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, tracing_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, binary_trace_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, profile_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, call_graph_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, memory_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, cache_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, pipeline_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, debug_observer_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, gdb_stub_tp)
+VM_INSTANTIATE_OBSERVER(virtual_machine_tp, history_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, null_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, detail_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, counting_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, tracing_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, binary_trace_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, profile_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, call_graph_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, memory_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, cache_observer_tp)
+VM_INSTANTIATE_OBSERVER(paged_virtual_machine_tp, pipeline_observer_tp)
+#undef VM_INSTANTIATE_OBSERVER
+
+} // namespace virtual_machine_nsp
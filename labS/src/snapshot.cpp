@@ -0,0 +1,185 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-01 20:31:17
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-01 20:31:17
+ * @Description  : binary snapshots of the virtual machine
+ */
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace virtual_machine_nsp {
+    const size_t kSnapshotPageBytes = sizeof(int16_t) * kMemoryPageSize;
+
+    template <typename Machine>
+    bool SaveSnapshot(const std::string &filename, const Machine &virtual_machine, uint64_t cycle) {
+        snapshot_header_tp header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.cycle = cycle;
+        for (int index = 0; index < kRegisterNumber; ++index) {
+            header.reg[index] = virtual_machine.reg[index];
+        }
+        header.image_begin = virtual_machine.image_begin;
+        header.image_size = virtual_machine.image_size;
+        header.psr = virtual_machine.ProcessorStatus();
+        header.saved_ssp = virtual_machine.saved_ssp;
+        header.saved_usp = virtual_machine.saved_usp;
+        header.timer_interval = virtual_machine.timer.interval;
+        header.timer_generation = virtual_machine.timer.generation;
+        header.timer_interrupt_enable = virtual_machine.timer.interrupt_enable;
+        header.timer_expired = virtual_machine.timer.expired;
+        header.timer_reprogrammed = virtual_machine.timer.reprogrammed;
+        header.keyboard_interrupt_enable = virtual_machine.keyboard_interrupt_enable;
+        header.keyboard_polling = virtual_machine.keyboard_polling;
+        for (int level = 0; level < 8; ++level) {
+            header.pending_vector[level] = virtual_machine.interrupts.Pending(level);
+        }
+        header.next_event_cycle = virtual_machine.next_event_cycle;
+        const std::vector<event_tp> &events = virtual_machine.events.Events();
+        header.event_count = events.size();
+        size_t head_size = sizeof(header) + sizeof(uint32_t) * kMemoryPageCount + sizeof(event_tp) * events.size();
+        size_t data_offset = (head_size + kSnapshotDataOffset - 1) / kSnapshotDataOffset * kSnapshotDataOffset;
+
+        // Only pages holding something are stored
+        std::vector<int16_t> data;
+        uint32_t page_offset[kMemoryPageCount] = {};
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            bool is_zero = true;
+            int16_t page[kMemoryPageSize];
+            for (int offset = 0; offset < kMemoryPageSize; ++offset) {
+                page[offset] = virtual_machine.mem.GetContent(index * kMemoryPageSize + offset);
+                is_zero = is_zero && page[offset] == 0;
+            }
+            if (!is_zero) {
+                page_offset[index] = data_offset + header.page_count++ * kSnapshotPageBytes;
+                data.insert(data.end(), page, page + kMemoryPageSize);
+            }
+        }
+
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        std::vector<char> head(data_offset, 0);
+        memcpy(head.data(), &header, sizeof(header));
+        memcpy(head.data() + sizeof(header), page_offset, sizeof(page_offset));
+        memcpy(head.data() + sizeof(header) + sizeof(page_offset), events.data(), sizeof(event_tp) * events.size());
+        out.write(head.data(), head.size());
+        out.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(int16_t));
+        return out.good();
+    }
+
+    template bool SaveSnapshot<virtual_machine_tp>(const std::string &, const virtual_machine_tp &, uint64_t);
+    template bool SaveSnapshot<paged_virtual_machine_tp>(const std::string &, const paged_virtual_machine_tp &,
+                                                         uint64_t);
+
+    bool LoadSnapshot(const std::string &filename, snapshot_tp &snapshot, std::string &error) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "cannot open " + filename;
+            return false;
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size < off_t(kSnapshotDataOffset)) {
+            close(fd);
+            error = filename + " is not a snapshot";
+            return false;
+        }
+        size_t size = status.st_size;
+        void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            error = "cannot map " + filename;
+            return false;
+        }
+        std::shared_ptr<const void> mapping(address, [size](const void *mapped) {
+            munmap(const_cast<void *>(mapped), size);
+        });
+
+        const char *base = static_cast<const char *>(address);
+        snapshot_header_tp header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0) {
+            error = filename + " is not a snapshot";
+            return false;
+        }
+        if (header.version != kSnapshotVersion) {
+            error = filename + " has unsupported snapshot version " + std::to_string(header.version);
+            return false;
+        }
+
+        size_t events_offset = sizeof(header) + sizeof(uint32_t) * kMemoryPageCount;
+        if (events_offset + sizeof(event_tp) * uint64_t(header.event_count) > size) {
+            error = filename + " is truncated";
+            return false;
+        }
+
+        std::shared_ptr<memory_image_tp> image(new memory_image_tp());
+        const uint32_t *page_offset = reinterpret_cast<const uint32_t *>(base + sizeof(header));
+        for (int index = 0; index < kMemoryPageCount; ++index) {
+            if (page_offset[index] == 0) {
+                continue;
+            }
+            if (page_offset[index] + kSnapshotPageBytes > size) {
+                error = filename + " is truncated";
+                return false;
+            }
+            image->SetPage(index, reinterpret_cast<const int16_t *>(base + page_offset[index]), mapping);
+        }
+        image->image_begin = header.image_begin;
+        image->image_size = header.image_size;
+
+        snapshot.image = image;
+        for (int index = 0; index < kRegisterNumber; ++index) {
+            snapshot.reg[index] = header.reg[index];
+        }
+        snapshot.cycle = header.cycle;
+        snapshot.user_mode = header.psr < 0;
+        snapshot.priority = (header.psr >> 8) & 7;
+        snapshot.saved_ssp = header.saved_ssp;
+        snapshot.saved_usp = header.saved_usp;
+        snapshot.timer.interval = header.timer_interval;
+        snapshot.timer.generation = header.timer_generation;
+        snapshot.timer.interrupt_enable = header.timer_interrupt_enable;
+        snapshot.timer.expired = header.timer_expired;
+        snapshot.timer.reprogrammed = header.timer_reprogrammed;
+        snapshot.keyboard_interrupt_enable = header.keyboard_interrupt_enable;
+        snapshot.keyboard_polling = header.keyboard_polling;
+        snapshot.interrupts = interrupt_controller_tp();
+        for (int level = 0; level < 8; ++level) {
+            if (header.pending_vector[level] >= 0) {
+                snapshot.interrupts.Raise(header.pending_vector[level], level);
+            }
+        }
+        snapshot.events = event_scheduler_tp();
+        for (uint32_t index = 0; index < header.event_count; ++index) {
+            event_tp event;
+            memcpy(&event, base + events_offset + index * sizeof(event_tp), sizeof(event));
+            snapshot.events.Post(event.cycle, event.kind, event.generation);
+        }
+        snapshot.next_event_cycle = header.next_event_cycle;
+        return true;
+    }
+
+    template <typename Machine>
+    void RestoreSnapshot(Machine &virtual_machine, const snapshot_tp &snapshot) {
+        virtual_machine.SetReg(snapshot.reg);
+        virtual_machine.cycle = snapshot.cycle;
+        virtual_machine.user_mode = snapshot.user_mode;
+        virtual_machine.priority = snapshot.priority;
+        virtual_machine.saved_ssp = snapshot.saved_ssp;
+        virtual_machine.saved_usp = snapshot.saved_usp;
+        virtual_machine.timer = snapshot.timer;
+        virtual_machine.keyboard_interrupt_enable = snapshot.keyboard_interrupt_enable;
+        virtual_machine.keyboard_polling = snapshot.keyboard_polling;
+        virtual_machine.interrupts = snapshot.interrupts;
+        virtual_machine.events = snapshot.events;
+        virtual_machine.next_event_cycle = snapshot.next_event_cycle;
+    }
+
+    template void RestoreSnapshot<virtual_machine_tp>(virtual_machine_tp &, const snapshot_tp &);
+    template void RestoreSnapshot<paged_virtual_machine_tp>(paged_virtual_machine_tp &, const snapshot_tp &);
+}; // virtual machine namespace
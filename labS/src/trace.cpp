@@ -0,0 +1,165 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-03 19:42:10
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-03 19:42:10
+ * @Description  : binary execution trace written by a background thread
+ */
+#include "trace.h"
+#include "compressed_trace.h"
+
+#include <chrono>
+
+namespace virtual_machine_nsp {
+    plain_trace_sink_tp::plain_trace_sink_tp(FILE *file, uint64_t first_cycle, const register_tp &initial)
+        : file(file) {
+        trace_header_tp header = {};
+        memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+        header.version = kTraceVersion;
+        header.first_cycle = first_cycle;
+        std::copy(initial.begin(), initial.end(), header.reg);
+        fwrite(&header, sizeof(header), 1, file);
+    }
+
+    void plain_trace_sink_tp::Write(const trace_record_tp *records, size_t count) {
+        fwrite(records, sizeof(trace_record_tp), count, file);
+    }
+
+    void plain_trace_sink_tp::Finish() {
+        fclose(file);
+    }
+
+    trace_writer_tp::trace_writer_tp(std::unique_ptr<trace_sink_tp> sink) : sink(std::move(sink)), ring(kRingCapacity) {
+        writer = std::thread(&trace_writer_tp::Drain, this);
+    }
+
+    trace_writer_tp::~trace_writer_tp() {
+        Close();
+    }
+
+    std::unique_ptr<trace_writer_tp> trace_writer_tp::Open(const std::string &filename, uint64_t first_cycle,
+                                                           const register_tp &initial, bool compressed) {
+        FILE *file = fopen(filename.c_str(), "wb");
+        if (file == nullptr) {
+            return nullptr;
+        }
+        std::unique_ptr<trace_sink_tp> sink;
+        if (compressed) {
+            sink.reset(new compressed_trace_sink_tp(file, first_cycle, initial));
+        } else {
+            sink.reset(new plain_trace_sink_tp(file, first_cycle, initial));
+        }
+        return std::unique_ptr<trace_writer_tp>(new trace_writer_tp(std::move(sink)));
+    }
+
+    void trace_writer_tp::Drain() {
+        std::vector<trace_record_tp> batch(4096);
+        while (true) {
+            // Read the flag first so records pushed before Close are not missed
+            bool last = stopping.load(std::memory_order_acquire);
+            size_t count = ring.TryPop(batch.data(), batch.size());
+            if (count != 0) {
+                sink->Write(batch.data(), count);
+            } else if (last) {
+                break;
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+
+    void trace_writer_tp::Close() {
+        if (closed) {
+            return;
+        }
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        sink->Finish();
+        closed = true;
+    }
+
+    template <typename Machine>
+    void binary_trace_observer_tp::BeforeExecute(Machine &vm, uint16_t, const instruction_tp &inst) {
+        // The stored word is read back after the instruction, the address
+        // of STI must be taken before the store can change its pointer
+        switch (inst.opcode) {
+            case O_ST:  store_address = vm.reg[R_PC] + inst.imm; break;
+            case O_STI: store_address = vm.mem.GetContent(uint16_t(vm.reg[R_PC] + inst.imm)); break;
+            case O_STR: store_address = vm.reg[inst.sr1] + inst.imm; break;
+            default: break;
+        }
+    }
+    template void binary_trace_observer_tp::BeforeExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void binary_trace_observer_tp::BeforeExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+
+    template <typename Machine>
+    void binary_trace_observer_tp::AfterExecute(Machine &vm, uint16_t pc, const instruction_tp &inst) {
+        trace_record_tp record = {};
+        record.pc = pc;
+        record.inst = inst.inst;
+        record.next_pc = vm.reg[R_PC];
+        record.flags = (vm.reg[R_COND] & 0x7) << T_COND_SHIFT;
+        // Usually one register, a native trap writes R0 and R7, an
+        // interrupt taken before the instruction R6
+        for (int index = R_R0; index <= R_R7; ++index) {
+            if (vm.reg[index] != traced[index]) {
+                record.reg_mask |= 1 << index;
+                record.reg_value[index] = vm.reg[index];
+            }
+        }
+        ApplyTraceRecord(traced, record);
+        if (inst.opcode == O_ST || inst.opcode == O_STI || inst.opcode == O_STR) {
+            record.mem_address = store_address;
+            record.mem_value = vm.mem.GetContent(store_address);
+            record.flags |= T_MEM_WRITE;
+        }
+        writer.Push(record);
+    }
+    template void binary_trace_observer_tp::AfterExecute(virtual_machine_tp &, uint16_t, const instruction_tp &);
+    template void binary_trace_observer_tp::AfterExecute(paged_virtual_machine_tp &, uint16_t, const instruction_tp &);
+
+    static bool ReadPlainTrace(std::ifstream &in, const std::string &filename, uint64_t from, uint64_t count,
+                               trace_range_tp &range, std::string &error) {
+        trace_header_tp header;
+        in.seekg(0);
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.version != kTraceVersion) {
+            error = filename + " is truncated or of an unsupported version";
+            return false;
+        }
+        from = std::max(from, header.first_cycle);
+        range.first_cycle = from;
+        std::copy(header.reg, header.reg + kRegisterNumber, range.state.begin());
+        range.records.clear();
+        // No index, replay everything before from
+        trace_record_tp record;
+        for (uint64_t cycle = header.first_cycle; cycle < from; ++cycle) {
+            if (!in.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+                return true;
+            }
+            ApplyTraceRecord(range.state, record);
+        }
+        while (range.records.size() < count && in.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+            range.records.push_back(record);
+        }
+        return true;
+    }
+
+    bool ReadTrace(const std::string &filename, uint64_t from, uint64_t count, trace_range_tp &range,
+                   std::string &error) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) {
+            error = "cannot open " + filename;
+            return false;
+        }
+        char magic[8] = {};
+        in.read(magic, sizeof(magic));
+        if (memcmp(magic, kTraceMagic, sizeof(magic)) == 0) {
+            return ReadPlainTrace(in, filename, from, count, range, error);
+        }
+        if (memcmp(magic, kCompressedTraceMagic, sizeof(magic)) == 0) {
+            return ReadCompressedTrace(in, filename, from, count, range, error);
+        }
+        error = filename + " is not a trace";
+        return false;
+    }
+}; // virtual machine namespace
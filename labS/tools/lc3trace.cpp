@@ -0,0 +1,116 @@
+/*
+ * @Author       : Chivier Humber
+ * @Date         : 2021-12-03 19:42:10
+ * @LastEditors  : Chivier Humber
+ * @LastEditTime : 2021-12-03 19:42:10
+ * @Description  : render a binary trace written by --binary-trace
+ *
+ * Build from labS:
+ *   g++ -std=gnu++17 -O2 -Iinclude tools/lc3trace.cpp src/simulator.cpp src/memory.cpp \
+ *       src/register.cpp src/observer.cpp src/trace.cpp src/compressed_trace.cpp \
+ *       -lboost_program_options -lz -o lc3trace
+ */
+#include "simulator.h"
+#include "trace.h"
+
+#include <iomanip>
+
+using namespace virtual_machine_nsp;
+
+// The simulator's option globals, unused here
+bool gIsSingleStepMode = false;
+bool gIsDetailedMode = false;
+std::string gInputFileName = "";
+std::string gRegisterStatusFileName = "";
+std::string gOutputFileName = "";
+int gBeginningAddress = 0x3000;
+int gEngine = 0;
+bool gIsFusionReportMode = false;
+std::string gBatchManifestFileName = "";
+std::string gBatchResultFileName = "";
+std::string gLockstepManifestFileName = "";
+int gThreadCount = 0;
+uint64_t gMaxSteps = UINT64_MAX;
+uint64_t gSnapshotCycle = 0;
+std::string gSnapshotFileName = "";
+std::string gRestoreFileName = "";
+
+namespace po = boost::program_options;
+
+// Same lines as detail_observer_tp writes to stdout, without the program's own output
+static void RenderDetailed(const trace_range_tp &range, bool registers_only) {
+    register_tp reg = range.state;
+    for (const trace_record_tp &record : range.records) {
+        instruction_tp inst = virtual_machine_tp::Decode(record.inst);
+        reg[R_PC] = record.pc + 1;
+        if (!registers_only) {
+            if (kOpcodeName[inst.opcode] != nullptr) {
+                std::cout << kOpcodeName[inst.opcode] << std::endl;
+            }
+            if (inst.opcode == O_BR || (inst.opcode == O_JSR && inst.flag)) {
+                std::cout << reg[R_PC] << std::endl;
+                std::cout << inst.imm << std::endl;
+            } else if (inst.opcode == O_JMP || inst.opcode == O_JSR) {
+                std::cout << reg[R_PC] << std::endl;
+                std::cout << reg[inst.sr1] << std::endl;
+            }
+        }
+        ApplyTraceRecord(reg, record);
+        std::cout << reg << std::endl;
+    }
+}
+
+// One line per record: cycle, pc, instruction and what it wrote
+static void RenderRaw(const trace_range_tp &range) {
+    uint64_t cycle = range.first_cycle;
+    for (const trace_record_tp &record : range.records) {
+        std::cout << std::dec << std::setfill(' ') << std::setw(10) << cycle++ << "  " << std::hex
+                  << std::setfill('0') << std::setw(4) << record.pc << ": " << std::setw(4) << uint16_t(record.inst)
+                  << " -> " << std::setw(4) << uint16_t(record.next_pc);
+        for (int index = R_R0; index <= R_R7; ++index) {
+            if (record.reg_mask & (1 << index)) {
+                std::cout << "  R" << index << " = " << std::setw(4) << uint16_t(record.reg_value[index]);
+            }
+        }
+        if (record.flags & T_MEM_WRITE) {
+            std::cout << "  [" << std::setw(4) << record.mem_address << "] = " << std::setw(4)
+                      << uint16_t(record.mem_value);
+        }
+        std::cout << '\n';
+    }
+}
+
+int main(int argc, char **argv) {
+    po::options_description desc{"\e[1mLC3 Trace Renderer\e[0m\n\n\e[1mOptions\e[0m"};
+    desc.add_options()
+        ("help,h", "Help screen")
+        ("trace", po::value<std::string>(), "Trace file written by --binary-trace")
+        ("registers", "Only the register dumps, as the -o file of detailed mode")
+        ("raw", "One line per instruction with its cycle, register and memory writes")
+        ("from", po::value<uint64_t>()->default_value(0), "First cycle to show")
+        ("count", po::value<uint64_t>()->default_value(UINT64_MAX), "Number of instructions to show");
+    po::positional_options_description positional;
+    positional.add("trace", 1);
+
+    po::variables_map vm;
+    store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    notify(vm);
+    if (vm.count("help") || !vm.count("trace")) {
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+
+    trace_range_tp range;
+    std::string error;
+    if (!ReadTrace(vm["trace"].as<std::string>(), vm["from"].as<uint64_t>(), vm["count"].as<uint64_t>(), range,
+                   error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (vm.count("raw")) {
+        RenderRaw(range);
+    } else {
+        RenderDetailed(range, vm.count("registers") != 0);
+    }
+    return 0;
+}